@@ -0,0 +1,117 @@
+//
+//  timer_wheel_bench.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+#include <sys/resource.h>
+#include "timer_wheel.hpp"
+
+// Usage: timer_wheel_bench [timers] [idle_seconds]
+// Schedules timers (100000) 10s to 5min out, reports the cost of schedule()
+// and cancel(), then idles for idle_seconds (10) with all of them pending
+// and reports the wakeups and CPU time that took. For comparison it idles
+// as long again on a 1ms steady_timer, the way a wheel that ticks every
+// tick would.
+
+using namespace bridge;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Counts the wheel's clock reads, one per wakeup while nothing schedules.
+class CountingWheel : public TimerWheel {
+ public:
+  using TimerWheel::TimerWheel;
+
+  mutable uint64_t reads = 0;
+
+ protected:
+  clock::time_point now() const override {
+    ++reads;
+    return clock::now();
+  }
+};
+
+double cpu_seconds() {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+double ns_per(clock_type::duration d, std::size_t n) {
+  return std::chrono::duration<double, std::nano>(d).count() / n;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  std::size_t n = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+  int idle = argc > 2 ? atoi(argv[2]) : 10;
+
+  boost::asio::io_context io;
+  CountingWheel wheel(io);
+  std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+  std::vector<clock_type::duration> delays;
+  std::mt19937_64 rng(1);
+  std::uniform_int_distribution<long> ms(10000, 300000);
+  for (std::size_t i = 0; i < n; ++i) {
+    timers.emplace_back(new TimerWheel::Timer());
+    delays.push_back(std::chrono::milliseconds(ms(rng)));
+  }
+
+  uint64_t fired = 0;
+  clock_type::time_point start = clock_type::now();
+  for (std::size_t i = 0; i < n; ++i) {
+    wheel.schedule(*timers[i], delays[i], [&fired] { ++fired; });
+  }
+  clock_type::duration scheduling = clock_type::now() - start;
+
+  start = clock_type::now();
+  for (std::size_t i = 0; i < n; i += 2) {
+    timers[i]->cancel();
+  }
+  clock_type::duration cancelling = clock_type::now() - start;
+  for (std::size_t i = 0; i < n; i += 2) {
+    wheel.schedule(*timers[i], delays[i], [&fired] { ++fired; });
+  }
+
+  printf("%zu timers: schedule %.0f ns, cancel %.0f ns\n", n,
+         ns_per(scheduling, n), ns_per(cancelling, (n + 1) / 2));
+
+  uint64_t reads = wheel.reads;
+  double cpu = cpu_seconds();
+  io.run_for(std::chrono::seconds(idle));
+  printf("wheel idle %ds: %llu wakeups, %.3f s CPU, %llu fired\n", idle,
+         (unsigned long long) (wheel.reads - reads), cpu_seconds() - cpu,
+         (unsigned long long) fired);
+
+  boost::asio::io_context tick_io;
+  boost::asio::steady_timer ticker(tick_io);
+  uint64_t ticks = 0;
+  std::function<void()> tick = [&] {
+    ticker.expires_after(std::chrono::milliseconds(1));
+    ticker.async_wait([&](const boost::system::error_code& ec) {
+      if (!ec) {
+        ++ticks;
+        tick();
+      }
+    });
+  };
+  tick();
+  cpu = cpu_seconds();
+  tick_io.run_for(std::chrono::seconds(idle));
+  printf("1ms ticker idle %ds: %llu wakeups, %.3f s CPU\n", idle,
+         (unsigned long long) ticks, cpu_seconds() - cpu);
+  return 0;
+}
@@ -0,0 +1,295 @@
+//
+//  acl.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include "acl.hpp"
+
+using namespace bridge;
+
+namespace {
+
+struct Rule {
+  bool allow = false;
+  int dir = -1;
+  int proto = -1;
+  uint32_t src_lo = 0;
+  uint32_t src_hi = UINT32_MAX;
+  uint32_t dst_lo = 0;
+  uint32_t dst_hi = UINT32_MAX;
+  uint32_t sport_lo = 0;
+  uint32_t sport_hi = 65535;
+  uint32_t dport_lo = 0;
+  uint32_t dport_hi = 65535;
+  bool has_addr = false;
+  bool has_port = false;
+};
+
+[[noreturn]] void syntax_error(int lineno, const std::string& what) {
+  throw std::runtime_error("acl line " + std::to_string(lineno) + ": " + what);
+}
+
+// Decimal digits only, no sign, no blanks, at most max.
+bool parse_uint(const std::string& s, unsigned long max, unsigned long& val) {
+  if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  errno = 0;
+  val = strtoul(s.c_str(), nullptr, 10);
+  return errno == 0 && val <= max;
+}
+
+void parse_cidr(const std::string& s, int lineno,
+                uint32_t& lo, uint32_t& hi) {
+  std::string addr = s;
+  unsigned long prefix = 32;
+  std::size_t slash = s.find('/');
+  if (slash != std::string::npos) {
+    addr = s.substr(0, slash);
+    if (!parse_uint(s.substr(slash + 1), 32, prefix)) {
+      syntax_error(lineno, "bad prefix in " + s);
+    }
+  }
+  struct in_addr in;
+  if (inet_pton(AF_INET, addr.c_str(), &in) != 1) {
+    syntax_error(lineno, "bad address " + s);
+  }
+  uint32_t mask = prefix ? ~(uint32_t) 0 << (32 - prefix) : 0;
+  lo = ntohl(in.s_addr) & mask;
+  hi = lo | ~mask;
+}
+
+void parse_ports(const std::string& s, int lineno,
+                 uint32_t& lo, uint32_t& hi) {
+  std::size_t dash = s.find('-');
+  unsigned long a = 0;
+  unsigned long b = 0;
+  if (!parse_uint(s.substr(0, dash), 65535, a)
+      || !parse_uint(dash == std::string::npos ? s : s.substr(dash + 1),
+                     65535, b)
+      || a > b) {
+    syntax_error(lineno, "bad port range " + s);
+  }
+  lo = (uint32_t) a;
+  hi = (uint32_t) b;
+}
+
+int parse_proto(const std::string& s, int lineno) {
+  if (s == "icmp") {
+    return 1;
+  } else if (s == "tcp") {
+    return 6;
+  } else if (s == "udp") {
+    return 17;
+  }
+  unsigned long n = 0;
+  if (!parse_uint(s, 255, n)) {
+    syntax_error(lineno, "bad protocol " + s);
+  }
+  return (int) n;
+}
+
+}
+
+void Acl::Field::add(uint32_t lo, uint32_t hi, unsigned rule) {
+  ranges_.push_back({lo, hi, rule});
+}
+
+void Acl::Field::compile(uint32_t max) {
+  starts_.push_back(0);
+  for (const Range& r : ranges_) {
+    starts_.push_back(r.lo);
+    if (r.hi < max) {
+      starts_.push_back(r.hi + 1);
+    }
+  }
+  std::sort(starts_.begin(), starts_.end());
+  starts_.erase(std::unique(starts_.begin(), starts_.end()), starts_.end());
+
+  bits_.assign(starts_.size(), 0);
+  for (std::size_t i = 0; i < starts_.size(); ++i) {
+    for (const Range& r : ranges_) {
+      if (r.lo <= starts_[i] && starts_[i] <= r.hi) {
+        bits_[i] |= (uint64_t) 1 << r.rule;
+      }
+    }
+  }
+  ranges_.clear();
+}
+
+uint64_t Acl::Field::lookup(uint32_t val) const {
+  auto it = std::upper_bound(starts_.begin(), starts_.end(), val);
+  return bits_[it - starts_.begin() - 1];
+}
+
+std::shared_ptr<const Acl> Acl::load(const std::string& path,
+                                     uint32_t client_id) {
+  std::ifstream is(path);
+  if (!is) {
+    throw std::runtime_error("cannot open acl " + path);
+  }
+
+  std::shared_ptr<Acl> acl(new Acl());
+  std::vector<Rule> rules;
+
+  std::string line;
+  for (int lineno = 1; std::getline(is, line); ++lineno) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ts(line);
+    std::string action;
+    if (!(ts >> action)) {
+      continue;
+    }
+
+    if (action == "default") {
+      std::string val;
+      ts >> val;
+      std::string extra;
+      if ((val != "allow" && val != "deny") || ts >> extra) {
+        syntax_error(lineno, "default must be allow or deny");
+      }
+      acl->default_allow_ = (val == "allow");
+      continue;
+    }
+
+    Rule rule;
+    if (action == "allow") {
+      rule.allow = true;
+    } else if (action != "deny") {
+      syntax_error(lineno, "unknown action " + action);
+    }
+
+    bool ours = true;
+    std::string key;
+    while (ts >> key) {
+      std::string val;
+      if (key == "in") {
+        rule.dir = 0;
+        continue;
+      } else if (key == "out") {
+        rule.dir = 1;
+        continue;
+      } else if (!(ts >> val)) {
+        syntax_error(lineno, key + " needs a value");
+      }
+
+      if (key == "proto") {
+        rule.proto = parse_proto(val, lineno);
+      } else if (key == "src") {
+        parse_cidr(val, lineno, rule.src_lo, rule.src_hi);
+        rule.has_addr = true;
+      } else if (key == "dst") {
+        parse_cidr(val, lineno, rule.dst_lo, rule.dst_hi);
+        rule.has_addr = true;
+      } else if (key == "sport") {
+        parse_ports(val, lineno, rule.sport_lo, rule.sport_hi);
+        rule.has_port = true;
+      } else if (key == "dport") {
+        parse_ports(val, lineno, rule.dport_lo, rule.dport_hi);
+        rule.has_port = true;
+      } else if (key == "client") {
+        unsigned long id = 0;
+        if (!parse_uint(val, UINT32_MAX, id) || id == 0) {
+          syntax_error(lineno, "bad client " + val);
+        }
+        ours = (id == client_id);
+      } else {
+        syntax_error(lineno, "unknown field " + key);
+      }
+    }
+
+    if (ours) {
+      if (rules.size() == max_rules) {
+        syntax_error(lineno, "too many rules");
+      }
+      rules.push_back(rule);
+    }
+  }
+
+  for (unsigned i = 0; i < rules.size(); ++i) {
+    const Rule& r = rules[i];
+    uint64_t bit = (uint64_t) 1 << i;
+    for (int d = 0; d < 2; ++d) {
+      if (r.dir < 0 || r.dir == d) {
+        acl->dir_[d] |= bit;
+      }
+    }
+    for (int p = 0; p < 256; ++p) {
+      if (r.proto < 0 || r.proto == p) {
+        acl->proto_[p] |= bit;
+      }
+    }
+    acl->src_.add(r.src_lo, r.src_hi, i);
+    acl->dst_.add(r.dst_lo, r.dst_hi, i);
+    acl->sport_.add(r.sport_lo, r.sport_hi, i);
+    acl->dport_.add(r.dport_lo, r.dport_hi, i);
+    if (!r.has_addr) {
+      acl->no_addr_ |= bit;
+    }
+    if (!r.has_port) {
+      acl->no_port_ |= bit;
+    }
+    if (r.allow) {
+      acl->allow_ |= bit;
+    }
+  }
+  acl->src_.compile(UINT32_MAX);
+  acl->dst_.compile(UINT32_MAX);
+  acl->sport_.compile(65535);
+  acl->dport_.compile(65535);
+
+  return acl;
+}
+
+bool Acl::allow(bool inbound, const uint8_t* pkt, std::size_t len) const {
+  if (len < 1) {
+    return default_allow_;
+  }
+
+  uint64_t bits = dir_[inbound ? 0 : 1];
+  int version = pkt[0] >> 4;
+
+  if (version == 4 && len >= 20) {
+    std::size_t ihl = (pkt[0] & 0x0f) * 4;
+    if (ihl < 20 || ihl > len) {
+      // Malformed, the ports would be read from inside the IP header.
+      return false;
+    }
+    uint8_t proto = pkt[9];
+    uint32_t src = ((uint32_t) pkt[12] << 24) | ((uint32_t) pkt[13] << 16)
+      | ((uint32_t) pkt[14] << 8) | pkt[15];
+    uint32_t dst = ((uint32_t) pkt[16] << 24) | ((uint32_t) pkt[17] << 16)
+      | ((uint32_t) pkt[18] << 8) | pkt[19];
+    bool first_frag = ((pkt[6] & 0x1f) | pkt[7]) == 0;
+
+    bits &= proto_[proto] & src_.lookup(src) & dst_.lookup(dst);
+    if ((proto == 6 || proto == 17) && !first_frag) {
+      // No ports in later fragments, they match port rules either way.
+    } else if ((proto == 6 || proto == 17) && len >= ihl + 4) {
+      const uint8_t* l4 = pkt + ihl;
+      bits &= sport_.lookup(((uint32_t) l4[0] << 8) | l4[1]);
+      bits &= dport_.lookup(((uint32_t) l4[2] << 8) | l4[3]);
+    } else {
+      bits &= no_port_;
+    }
+  } else {
+    if (version == 6 && len >= 40) {
+      bits &= proto_[pkt[6]];
+    }
+    bits &= no_addr_ & no_port_;
+  }
+
+  if (!bits) {
+    return default_allow_;
+  }
+  return (allow_ >> __builtin_ctzll(bits)) & 1;
+}
@@ -0,0 +1,86 @@
+//
+//  acl.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef acl_hpp
+#define acl_hpp
+
+#include <array>
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bridge {
+
+// Inner packet access control list.
+//
+// Rules are read from a file, one per line, first match wins:
+//   allow|deny [in|out] [proto tcp|udp|icmp|<n>] [src <cidr>] [dst <cidr>]
+//              [sport <port>[-<port>]] [dport <port>[-<port>]] [client <id>]
+//   default allow|deny
+// "out" is TUN -> wire, "in" is wire -> TUN. Rules for another client_id
+// are ignored. Packets matching no rule get the default, allow if unset.
+//
+// The rules are compiled into one bitset per elementary interval of every
+// field (Lakshman-Stiliadis bit vectors), so classification is a handful
+// of binary searches and ANDs; the lowest bit left set is the first
+// matching rule. Only IPv4 addresses and ports are classified, other
+// packets only match rules without address or port constraints.
+// Non-first TCP/UDP fragments carry no ports and match port rules as if
+// their ports matched, so a port deny rule also drops all later fragments
+// between the hosts it names. IPv4 packets with a bad IHL are always
+// dropped.
+class Acl {
+ public:
+  static constexpr std::size_t max_rules = 64;
+
+  // Throw exceptions on syntax errors or too many rules.
+  static std::shared_ptr<const Acl> load(const std::string& path,
+                                         uint32_t client_id);
+
+  bool allow(bool inbound, const uint8_t* pkt, std::size_t len) const;
+
+ private:
+  // Rule bitsets of one field over [0, max].
+  class Field {
+   public:
+    void add(uint32_t lo, uint32_t hi, unsigned rule);
+    void compile(uint32_t max);
+    uint64_t lookup(uint32_t val) const;
+
+   private:
+    struct Range {
+      uint32_t lo;
+      uint32_t hi;
+      unsigned rule;
+    };
+
+    std::vector<Range> ranges_;
+    std::vector<uint32_t> starts_;
+    std::vector<uint64_t> bits_;
+  };
+
+  Acl() = default;
+
+  std::array<uint64_t, 2> dir_{};
+  std::array<uint64_t, 256> proto_{};
+  Field src_;
+  Field dst_;
+  Field sport_;
+  Field dport_;
+  // Rules without address, resp. port constraints.
+  uint64_t no_addr_ = 0;
+  uint64_t no_port_ = 0;
+  // Bit set for allow rules.
+  uint64_t allow_ = 0;
+  bool default_allow_ = true;
+};
+
+}
+
+#endif /* acl_hpp */
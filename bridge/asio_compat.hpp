@@ -0,0 +1,16 @@
+//
+//  asio_compat.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef asio_compat_hpp
+#define asio_compat_hpp
+
+// Include asio through here. Boost 1.74's awaitable.hpp uses
+// std::exchange without including <utility> itself.
+#include <utility>
+#include <boost/asio.hpp>
+
+#endif /* asio_compat_hpp */
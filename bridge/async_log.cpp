@@ -0,0 +1,213 @@
+//
+//  async_log.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "async_log.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// An error code, or an id and an address with has_addr.
+struct Entry {
+  LogSite* site;
+  boost::system::error_code ec;
+  uint64_t id;
+  boost::asio::ip::udp::endpoint addr;
+  bool has_addr;
+  uint32_t suppressed;
+};
+
+// Bounded multi-producer queue (D. Vyukov), every cell carries a sequence
+// number telling producers and the consumer whose turn it is.
+class LogQueue {
+ public:
+  static constexpr std::size_t capacity = 1024;
+
+  LogQueue() {
+    for (std::size_t i = 0; i < capacity; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool push(const Entry& entry) {
+    std::size_t pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[pos & (capacity - 1)];
+      std::size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.entry = entry;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Single consumer.
+  bool empty() const {
+    const Cell& cell = cells_[head_ & (capacity - 1)];
+    return (intptr_t) cell.seq.load(std::memory_order_acquire)
+      - (intptr_t) (head_ + 1) < 0;
+  }
+
+  bool pop(Entry& entry) {
+    Cell& cell = cells_[head_ & (capacity - 1)];
+    std::size_t seq = cell.seq.load(std::memory_order_acquire);
+    if ((intptr_t) seq - (intptr_t) (head_ + 1) < 0) {
+      return false;
+    }
+    entry = cell.entry;
+    cell.seq.store(head_ + capacity, std::memory_order_release);
+    ++head_;
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<std::size_t> seq;
+    Entry entry;
+  };
+
+  Cell cells_[capacity];
+  std::atomic<std::size_t> tail_{0};
+  std::size_t head_ = 0;
+};
+
+// Sleeps on a condition variable while the queue is empty. Producers stay
+// lock-free unless they have to wake it.
+class LogBackend {
+ public:
+  LogBackend() : thread_([this]() { run(); }) { }
+
+  ~LogBackend() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  bool push(const Entry& entry) {
+    if (!queue_.push(entry)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_one();
+    }
+    return true;
+  }
+
+ private:
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      // Announce the sleep before the last look at the queue, so a push
+      // either lands before that look or sees sleeping_ and wakes us.
+      sleeping_.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+      sleeping_.store(false);
+      bool stop = stop_;
+      lock.unlock();
+      Entry entry;
+      while (queue_.pop(entry)) {
+        write(entry);
+      }
+      if (stop) {
+        break;
+      }
+      lock.lock();
+    }
+  }
+
+  static void write(const Entry& entry) {
+    const LogSite& site = *entry.site;
+    google::LogMessage msg(site.file, site.line, site.severity);
+    if (entry.has_addr) {
+      msg.stream() << site.msg << "(" << entry.id << ") " << entry.addr;
+    } else {
+      msg.stream() << site.msg << ": " << entry.ec.message()
+        << " (" << entry.ec << ")";
+    }
+    if (entry.suppressed) {
+      msg.stream() << ", " << entry.suppressed << " similar suppressed";
+    }
+  }
+
+  LogQueue queue_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::atomic<bool> sleeping_{false};
+  std::thread thread_;
+};
+
+LogBackend& backend() {
+  static LogBackend instance;
+  return instance;
+}
+
+}
+
+void bridge::start_log_backend() {
+  backend();
+}
+
+namespace {
+
+// Let the message through the rate limit and queue it.
+void submit(LogSite& site, Entry& entry) {
+  uint64_t now = std::chrono::duration_cast<std::chrono::seconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+  if (site.window.load(std::memory_order_relaxed) != now) {
+    site.window.store(now, std::memory_order_relaxed);
+    site.count.store(0, std::memory_order_relaxed);
+  }
+  if (site.count.fetch_add(1, std::memory_order_relaxed) >= log_rate_limit) {
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  entry.site = &site;
+  entry.suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+  if (!backend().push(entry)) {
+    site.suppressed.fetch_add(entry.suppressed + 1, std::memory_order_relaxed);
+  }
+}
+
+}
+
+void bridge::log_error(LogSite& site, const boost::system::error_code& ec) {
+  Entry entry;
+  entry.ec = ec;
+  entry.id = 0;
+  entry.has_addr = false;
+  submit(site, entry);
+}
+
+void bridge::log_addr(LogSite& site, uint64_t id,
+                      const boost::asio::ip::udp::endpoint& addr) {
+  Entry entry;
+  entry.id = id;
+  entry.addr = addr;
+  entry.has_addr = true;
+  submit(site, entry);
+}
@@ -0,0 +1,63 @@
+//
+//  async_log.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef async_log_hpp
+#define async_log_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <boost/system/error_code.hpp>
+#include <glog/logging.h>
+#include "asio_compat.hpp"
+
+namespace bridge {
+
+// One per call site, see BRIDGE_LOG_EC and BRIDGE_LOG_ADDR.
+struct LogSite {
+  google::LogSeverity severity;
+  const char* file;
+  int line;
+  const char* msg;
+  // Rate limiting state: the current one-second window, how many messages
+  // were let through in it and how many were dropped since the last one.
+  std::atomic<uint64_t> window{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint32_t> suppressed{0};
+};
+
+// Queue a message for logging by the backend thread.
+// Formatting and the glog call happen off the calling thread; at most
+// log_rate_limit messages per second and call site get through, the rest
+// are counted and reported with the next message from that site.
+void log_error(LogSite& site, const boost::system::error_code& ec);
+void log_addr(LogSite& site, uint64_t id,
+              const boost::asio::ip::udp::endpoint& addr);
+
+constexpr uint32_t log_rate_limit = 10;
+
+// Start the backend thread now instead of with the first message, e.g.
+// before pinning the calling thread.
+void start_log_backend();
+
+}
+
+// Replacements for LOG on the per-packet paths:
+//   LOG(severity) << msg << ": " << ec.message() << " (" << ec << ")";
+#define BRIDGE_LOG_EC(severity, msg, ec) do { \
+  static bridge::LogSite bridge_log_site_{google::GLOG_##severity, \
+                                          __FILE__, __LINE__, msg}; \
+  bridge::log_error(bridge_log_site_, ec); \
+} while (0)
+
+//   LOG(severity) << msg << "(" << id << ") " << addr;
+#define BRIDGE_LOG_ADDR(severity, msg, id, addr) do { \
+  static bridge::LogSite bridge_log_site_{google::GLOG_##severity, \
+                                          __FILE__, __LINE__, msg}; \
+  bridge::log_addr(bridge_log_site_, id, addr); \
+} while (0)
+
+#endif /* async_log_hpp */
@@ -0,0 +1,134 @@
+//
+//  busy_poll.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glog/logging.h>
+#include "busy_poll.hpp"
+
+using namespace bridge;
+
+void bridge::pin_thread(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+    throw std::runtime_error("cannot pin thread to cpu " + std::to_string(cpu));
+  }
+#else
+  // macOS only offers affinity tags as a scheduling hint.
+  throw std::runtime_error("cpu pinning is not supported on this platform");
+#endif
+}
+
+bool bridge::set_busy_poll(int fd, unsigned usecs) {
+#if defined(SO_BUSY_POLL)
+  int val = (int) usecs;
+  return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) == 0;
+#else
+  (void) fd;
+  (void) usecs;
+  return false;
+#endif
+}
+
+BusyPoller::BusyPoller(boost::asio::io_context& io, unsigned spin_us)
+    : io_(io),
+      spin_(std::chrono::microseconds(spin_us)),
+      report_at_(clock::now() + std::chrono::seconds(60)) { }
+
+BusyPoller::~BusyPoller() { }
+
+void BusyPoller::run() {
+  clock::time_point idle_since = clock::now();
+
+  while (!io_.stopped()) {
+    std::size_t n = io_.poll();
+    clock::time_point now = clock::now();
+    if (n) {
+      polled_ += n;
+      idle_since = now;
+    } else if (now - idle_since >= spin_) {
+      // Spin budget exhausted, let the reactor sleep until work arrives.
+      woken_ += io_.run_one();
+      now = clock::now();
+      idle_since = now;
+    }
+    if (now >= report_at_) {
+      report(now);
+    }
+  }
+}
+
+void BusyPoller::report(clock::time_point now) {
+  if (polled_ || woken_) {
+    LOG(INFO) << "busy-poll: handlers polled=" << polled_
+      << ", after blocking=" << woken_;
+  }
+  polled_ = 0;
+  woken_ = 0;
+  report_at_ = now + std::chrono::seconds(60);
+}
+
+namespace {
+
+constexpr std::chrono::milliseconds probe_interval(100);
+constexpr std::chrono::seconds probe_report_interval(60);
+
+}
+
+WakeupProbe::WakeupProbe(boost::asio::io_context& io, const std::string& mode)
+    : timer_(io),
+      mode_(mode),
+      report_at_(clock::now() + probe_report_interval) {
+  samples_.reserve(probe_report_interval / probe_interval);
+}
+
+WakeupProbe::~WakeupProbe() {
+  timer_.cancel();
+}
+
+void WakeupProbe::start() {
+  timer_.expires_after(probe_interval);
+  timer_.async_wait(std::bind(&WakeupProbe::handler, this,
+                              std::placeholders::_1));
+}
+
+void WakeupProbe::handler(const boost::system::error_code& ec) {
+  if (ec) {
+    return;
+  }
+  clock::time_point now = clock::now();
+  samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    now - timer_.expiry()).count());
+  if (now >= report_at_) {
+    report(now);
+  }
+  start();
+}
+
+void WakeupProbe::report(clock::time_point now) {
+  if (!samples_.empty()) {
+    uint64_t sum = 0;
+    for (uint64_t v : samples_) {
+      sum += v;
+    }
+    std::size_t n = samples_.size();
+    auto p99 = samples_.begin() + n * 99 / 100;
+    std::nth_element(samples_.begin(), p99, samples_.end());
+    uint64_t max = *std::max_element(samples_.begin(), samples_.end());
+    LOG(INFO) << mode_ << " wakeup latency: avg=" << sum / n / 1000
+      << "us, p99=" << *p99 / 1000 << "us, max=" << max / 1000 << "us";
+  }
+  samples_.clear();
+  report_at_ = now + probe_report_interval;
+}
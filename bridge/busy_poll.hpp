@@ -0,0 +1,86 @@
+//
+//  busy_poll.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef busy_poll_hpp
+#define busy_poll_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "asio_compat.hpp"
+
+namespace bridge {
+
+// Pin the calling thread to the given core. Threads it creates later
+// inherit the pin.
+// Throw exceptions if the platform refuses.
+void pin_thread(int cpu);
+
+// Ask the kernel to busy-poll the device queue on socket reads.
+// Return false if SO_BUSY_POLL is unavailable or not permitted.
+bool set_busy_poll(int fd, unsigned usecs);
+
+// Drive an io_context without sleeping in the reactor.
+// Ready handlers are polled in a tight loop; only after spin_us without any
+// work does the poller fall back to a blocking run_one().
+class BusyPoller {
+ public:
+  explicit BusyPoller(boost::asio::io_context& io, unsigned spin_us);
+  virtual ~BusyPoller();
+
+  void run();
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  void report(clock::time_point now);
+
+  boost::asio::io_context& io_;
+  clock::duration spin_;
+  clock::time_point report_at_;
+
+  // Handlers dispatched while spinning.
+  uint64_t polled_ = 0;
+  // Handlers dispatched after the spin budget ran out and we blocked.
+  uint64_t woken_ = 0;
+
+  BusyPoller(const BusyPoller&) = delete;
+  BusyPoller& operator=(const BusyPoller&) = delete;
+};
+
+// Measures the readiness-to-dispatch latency of whatever drives the
+// io_context: how late a due timer's handler runs. A sleeping reactor adds
+// its wakeup to this, the same as for a readable socket. Samples 10 times
+// a second and logs avg, p99 and max every 60 seconds, so busy-poll and
+// the default run() can be compared.
+class WakeupProbe {
+ public:
+  explicit WakeupProbe(boost::asio::io_context& io, const std::string& mode);
+  virtual ~WakeupProbe();
+
+  void start();
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  void handler(const boost::system::error_code& ec);
+  void report(clock::time_point now);
+
+  boost::asio::steady_timer timer_;
+  std::string mode_;
+  clock::time_point report_at_;
+  // Lateness of each sample in nanoseconds since the last report.
+  std::vector<uint64_t> samples_;
+
+  WakeupProbe(const WakeupProbe&) = delete;
+  WakeupProbe& operator=(const WakeupProbe&) = delete;
+};
+
+}
+
+#endif /* busy_poll_hpp */
@@ -5,11 +5,18 @@
 //  Created by 冀宸 on 2022/2/1.
 //
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
-#include <thread>
+#include <sstream>
+#include <stdexcept>
 #include <glog/logging.h>
+#include "async_log.hpp"
+#include "busy_poll.hpp"
+#include "control.hpp"
 #include "crypto.hpp"
+#include "pipeline.hpp"
+#include "probes.hpp"
 #include "client.hpp"
 
 #if defined(__APPLE__)
@@ -28,136 +35,590 @@ std::chrono::duration_cast<std::chrono::microseconds> \
 
 using namespace bridge;
 
+namespace {
+
+// Probes are checked every tick. The active server is probed more often
+// than the others, so that its failure shows quickly.
+constexpr std::chrono::milliseconds probe_tick(20);
+constexpr uint64_t active_probe_interval_us = 100000;
+constexpr uint64_t probe_interval_us = 500000;
+// A probe counts as lost once it is unanswered for four round trips,
+// within these bounds.
+constexpr uint64_t min_probe_timeout_us = 100000;
+constexpr uint64_t max_probe_timeout_us = 500000;
+// After a switch stay with the new server for a hold-down, unless it
+// fails. The hold-down doubles with every switch that follows the last
+// one within flap_window_us, up to max_hold_down_us.
+constexpr uint64_t min_hold_down_us = 5000000;
+constexpr uint64_t max_hold_down_us = 80000000;
+constexpr uint64_t flap_window_us = 60000000;
+// A server is only judged better on a full probe history.
+constexpr unsigned history_len = 16;
+// Once the handshake is over, HELLO is repeated this often so that every
+// server keeps confirming our session index. A server that restarted or
+// expired the session hands out a new one.
+constexpr std::chrono::seconds keepalive_interval(10);
+// Without a WELCOME for this long, go back to full headers.
+constexpr uint64_t session_timeout_us = 30000000;
+// A server is down once down_losses of its last down_window probes went
+// unanswered; a single lost probe is not enough to fail over.
+constexpr unsigned down_window = 4;
+constexpr unsigned down_losses = 2;
+
+uint64_t steady_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+unsigned Client::Peer::lost(unsigned window) const {
+  unsigned n = std::min(probes, window);
+  unsigned mask = (1u << n) - 1;
+  return n - __builtin_popcount(history & mask);
+}
+
+void Client::Peer::record(bool answered) {
+  history = (uint16_t) ((history << 1) | answered);
+  ++probes;
+  probe_us = 0;
+}
+
+bool Client::Peer::down() const {
+  return !srtt_us || lost(down_window) >= down_losses;
+}
+
+uint64_t Client::Peer::score() const {
+  if (down()) {
+    return UINT64_MAX;
+  }
+  // The round trip, raised by the loss rate over the whole history.
+  return srtt_us * (16 + lost()) / 16;
+}
+
 Client::Client(boost::asio::io_context& io, const std::string& ip,
-               const std::string& port, uint32_t client_id)
+               const std::string& port, uint32_t client_id,
+               const Options& opts, PacketHandler handler)
     : io_(io),
       ifname_(),
-      fd_(io, opentun(ifname_)),
+      fd_(io),
       socket_(io),
+      timer_(io),
+      probe_timer_(io),
+      wheel_(io),
+      io_depth_(std::max(opts.io_depth, 1u)),
       client_id_(client_id),
+      handler_(std::move(handler)),
+      pipeline_(CryptoPipeline(PlatformHeader(),
+                               AclFilter(opts.acl_file.empty() ? nullptr
+                                         : Acl::load(opts.acl_file, client_id)),
+                               Cipher(client_id)),
+                Stats()),
       gen_id_(TIMESTAMP_US()) {
-  fd_.non_blocking(true);
+  for (unsigned i = 0; i < io_depth_; ++i) {
+    backoff_timers_.emplace_back(io_);
+  }
+  if (!handler_) {
+    fd_.assign(opentun(ifname_));
+    fd_.non_blocking(true);
+  }
+  if (!opts.impair.empty()) {
+    impair_ = std::make_unique<Impairment>(
+      wheel_, opts.impair, [this](const Datagram& dgram) { transmit(dgram); });
+  }
+  if (opts.crypto_workers) {
+    pool_ = std::make_unique<boost::asio::thread_pool>(opts.crypto_workers);
+    // Stats is not thread-safe, count once the packet is back in order.
+    tx_queue_ = std::make_unique<OrderedQueue>(
+      io_, *pool_, opts.crypto_workers,
+      [this](Packet& pkt) {
+        return pipeline_.stage<CryptoPipeline>().outbound(pkt);
+      },
+      [this](OrderedQueue::Job& job) {
+        pipeline_.stage<Stats>().outbound(job.pkt);
+        send_packet(std::static_pointer_cast<buf_type>(job.owner), job.addr,
+                    job.pkt);
+      });
+    rx_queue_ = std::make_unique<OrderedQueue>(
+      io_, *pool_, opts.crypto_workers,
+      [this](Packet& pkt) {
+        return pipeline_.stage<CryptoPipeline>().inbound(pkt);
+      },
+      [this](OrderedQueue::Job& job) {
+        if (Peer* peer = find_peer(job.addr)) {
+          write_packet(std::static_pointer_cast<buf_type>(job.owner), *peer,
+                       job.pkt);
+        }
+      });
+  }
   boost::asio::ip::udp::resolver resolver(io_);
-  auto ep = *resolver.resolve(ip.c_str(), port.c_str()).begin();
-  socket_.connect(ep.endpoint());
+  std::istringstream hosts(ip);
+  std::string host;
+  while (std::getline(hosts, host, ',')) {
+    Peer peer;
+    peer.addr = resolver.resolve(host.c_str(), port.c_str()).begin()->endpoint();
+    if (!peers_.empty() && peer.addr.protocol() != peers_[0].addr.protocol()) {
+      throw std::runtime_error("servers must share one address family");
+    }
+    peers_.push_back(peer);
+  }
+  if (peers_.empty()) {
+    throw std::runtime_error("no server address");
+  }
+  socket_.open(peers_[0].addr.protocol());
+  socket_.bind(addr_type(peers_[0].addr.protocol(), 0));
   socket_.non_blocking(true);
+  DatagramSink paced;
+  if (impair_) {
+    paced = [this](const Datagram& dgram) { impair_->submit(dgram); };
+  } else {
+    paced = [this](const Datagram& dgram) { transmit(dgram); };
+  }
+  pacer_ = std::make_unique<Pacer>(wheel_, socket_.native_handle(),
+                                   opts.pace_kbit, opts.pace_auto,
+                                   opts.pace_edt, std::move(paced));
+  if (opts.busy_poll_us
+      && !set_busy_poll(socket_.native_handle(), opts.busy_poll_us)) {
+    LOG(WARNING) << "SO_BUSY_POLL unavailable, spinning in user space only";
+  }
 
   LOG(INFO) << "client(" << gen_id_ << ") " << socket_.local_endpoint() << " up";
-  LOG(INFO) << ifname_ << " is opened, fd=" << fd_.native_handle();
+  if (!handler_) {
+    LOG(INFO) << ifname_ << " is opened, fd=" << fd_.native_handle();
 #if defined(__APPLE__)
-  LOG(INFO) << "hint:$ sudo ifconfig " << ifname_ << " inet 192.168.33.10/24 192.168.33.1 mtu 1448 up";
-  LOG(INFO) << "hint:$ sudo route add -host " << ip << " -gateway <gw>";
-  LOG(INFO) << "hint:$ sudo route add -net <x.x.x.x/yy> -gateway 192.168.33.1";
+    LOG(INFO) << "hint:$ sudo ifconfig " << ifname_ << " inet 192.168.33.10/24 192.168.33.1 mtu 1448 up";
+    for (const Peer& peer : peers_) {
+      LOG(INFO) << "hint:$ sudo route add -host " << peer.addr.address()
+        << " -gateway <gw>";
+    }
+    LOG(INFO) << "hint:$ sudo route add -net <x.x.x.x/yy> -gateway 192.168.33.1";
 #elif defined(__linux__)
-  LOG(INFO) << "hint:$ sudo ip a add dev " << ifname_ << " 192.168.33.10/24";
-  LOG(INFO) << "hint:$ sudo ip l set dev " << ifname_ << " mtu 1448 up";
-  LOG(INFO) << "hint:$ sudo route add " << ip << " gw <gw>";
-  LOG(INFO) << "hint:$ sudo route add <x.x.x.x/yy> gw 192.168.33.1";
+    LOG(INFO) << "hint:$ sudo ip a add dev " << ifname_ << " 192.168.33.10/24";
+    LOG(INFO) << "hint:$ sudo ip l set dev " << ifname_ << " mtu 1448 up";
+    for (const Peer& peer : peers_) {
+      LOG(INFO) << "hint:$ sudo route add " << peer.addr.address()
+        << " gw <gw>";
+    }
+    LOG(INFO) << "hint:$ sudo route add <x.x.x.x/yy> gw 192.168.33.1";
 #endif
+  }
 }
 
 Client::~Client() {
+  if (pool_) {
+    pool_->join();
+  }
+  timer_.cancel();
+  probe_timer_.cancel();
+  for (boost::asio::steady_timer& timer : backoff_timers_) {
+    timer.cancel();
+  }
   socket_.close();
   fd_.close();
 }
 
 void Client::start() {
-  start_reading();
-  start_receiving();
+  for (unsigned i = 0; i < io_depth_; ++i) {
+    if (!handler_) {
+      boost::asio::co_spawn(io_, read_loop(backoff_timers_[i]),
+                            boost::asio::detached);
+    }
+    boost::asio::co_spawn(io_, receive_loop(), boost::asio::detached);
+  }
+  start_handshake();
+  start_feedback();
+  if (peers_.size() > 1) {
+    probe_handler(boost::system::error_code());
+  }
 }
 
-void Client::start_reading() {
-  buf_ptr pbuf = std::make_shared<buf_type>();
-  fd_.async_read_some(boost::asio::buffer(pbuf->data() + crypto_header_len,
-                                          pbuf->size() - crypto_header_len),
-                      std::bind(&Client::read_handler, this, pbuf,
-                                std::placeholders::_1, std::placeholders::_2));
+void Client::submit(const PacketView* pkts, std::size_t n) {
+  for (std::size_t i = 0; i < n; ++i) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    if (pkts[i].len > pbuf->size() - crypto_header_len - tun_frame_len) {
+      continue;
+    }
+    forward_packet(pbuf, frame_packet(pbuf->data() + crypto_header_len,
+                                      pkts[i]));
+  }
 }
 
-void Client::start_receiving() {
-  buf_ptr pbuf = std::make_shared<buf_type>();
-  socket_.async_receive(boost::asio::buffer(*pbuf),
-                        std::bind(&Client::receive_handler, this, pbuf,
-                                  std::placeholders::_1, std::placeholders::_2));
+void Client::start_handshake() {
+  for (Peer& peer : peers_) {
+    if (!peer.session_idx) {
+      send_control(peer, control_hello, 0);
+    }
+  }
+  timer_.expires_after(boost::asio::chrono::seconds(1));
+  timer_.async_wait(std::bind(&Client::handshake_handler, this,
+                              std::placeholders::_1));
+}
+
+void Client::start_keepalive() {
+  timer_.expires_after(keepalive_interval);
+  timer_.async_wait(std::bind(&Client::keepalive_handler, this,
+                              std::placeholders::_1));
+}
+
+void Client::start_probing() {
+  probe_timer_.expires_after(probe_tick);
+  probe_timer_.async_wait(std::bind(&Client::probe_handler, this,
+                                    std::placeholders::_1));
+}
+
+void Client::start_feedback() {
+  wheel_.schedule(feedback_timer_, rate_report_interval,
+                  [this] { feedback_handler(); });
+}
+
+boost::asio::awaitable<void> Client::read_loop(
+    boost::asio::steady_timer& timer) {
+  std::chrono::milliseconds backoff(0);
+  for (;;) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    boost::system::error_code ec;
+    std::size_t nbytes = co_await fd_.async_read_some(
+      boost::asio::buffer(pbuf->data() + crypto_header_len,
+                          pbuf->size() - crypto_header_len),
+      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec) {
+      if (ec == boost::system::errc::operation_canceled) {
+        co_return;
+      }
+      BRIDGE_LOG_EC(WARNING, "client read error", ec);
+      // Back off without blocking the io thread, the socket keeps running.
+      // Only cancel() ends the wait early, so it stops the loop.
+      backoff = std::min(std::max(backoff * 2, std::chrono::milliseconds(1)),
+                         std::chrono::milliseconds(1000));
+      timer.expires_after(backoff);
+      co_await timer.async_wait(
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+      if (ec) {
+        co_return;
+      }
+      continue;
+    }
+
+    backoff = std::chrono::milliseconds(0);
+    forward_packet(pbuf, nbytes);
+  }
+}
+
+boost::asio::awaitable<void> Client::receive_loop() {
+  for (;;) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    addr_type addr;
+    boost::system::error_code ec;
+    std::size_t nbytes = co_await socket_.async_receive_from(
+      boost::asio::buffer(*pbuf), addr,
+      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec) {
+      if (ec == boost::system::errc::operation_canceled) {
+        co_return;
+      }
+      BRIDGE_LOG_EC(WARNING, "client receive error", ec);
+      continue;
+    }
+
+    receive_packet(pbuf, addr, nbytes);
+  }
+}
+
+void Client::forward_packet(buf_ptr pbuf, std::size_t nbytes) {
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = crypto_header_len;
+  pkt.len = nbytes;
+  pkt.gen_id = gen_id_;
+  pkt.seq = ++tx_cnt_;
+  // Stick to this server even if we switch while the packet is queued,
+  // its session index is baked into the header.
+  Peer& peer = peers_[active_];
+  pkt.session_idx = peer.session_idx;
+  BRIDGE_TRACE(tun_read, pkt.seq, nbytes);
+
+  if (tx_queue_) {
+    if (!tx_queue_->submit({pkt, pbuf, peer.addr})) {
+      --tx_cnt_;
+      BRIDGE_TRACE(queue_drop, pkt.seq, pkt.len);
+    }
+    return;
+  }
+
+  if (!pipeline_.outbound(pkt)) {
+    --tx_cnt_;
+    return;
+  }
+
+  send_packet(pbuf, peer.addr, pkt);
 }
 
-void Client::read_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                          std::size_t nbytes) {
+Client::Peer* Client::find_peer(const addr_type& addr) {
+  auto it = std::find_if(peers_.begin(), peers_.end(),
+                         [&](const Peer& peer) { return peer.addr == addr; });
+  return it == peers_.end() ? nullptr : &*it;
+}
+
+void Client::receive_packet(buf_ptr pbuf, const addr_type& addr,
+                            std::size_t nbytes) {
+  Peer* ppeer = find_peer(addr);
+  if (!ppeer) {
+    return;
+  }
+  Peer& peer = *ppeer;
+
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = 0;
+  pkt.len = nbytes;
+  pkt.session_idx = peer.session_idx;
+  BRIDGE_TRACE(receive, Decryptor(client_id_, pkt.buf, nbytes).peek_seq(),
+               nbytes);
+
+  if (rx_queue_) {
+    if (!rx_queue_->submit({pkt, pbuf, addr})) {
+      BRIDGE_TRACE(queue_drop,
+                   Decryptor(client_id_, pkt.buf, pkt.len).peek_seq(), pkt.len);
+    }
+    return;
+  }
+
+  if (!pipeline_.inbound(pkt)) {
+    return;
+  }
+
+  write_packet(pbuf, peer, pkt);
+}
+
+void Client::send_packet(buf_ptr pbuf, const addr_type& addr,
+                         const Packet& pkt) {
+  BRIDGE_TRACE(send, pkt.seq, pkt.len);
+  Datagram dgram{pbuf, pkt.data(), pkt.len, addr};
+  pacer_->submit(dgram);
+}
+
+void Client::transmit(const Datagram& dgram) {
+  if (dgram.txtime && send_at(socket_.native_handle(), dgram.data, dgram.len,
+                              dgram.addr.data(), dgram.addr.size(),
+                              dgram.txtime)) {
+    return;
+  }
+  socket_.async_send_to(boost::asio::buffer(dgram.data, dgram.len),
+                        dgram.addr,
+                        [owner = dgram.owner](const boost::system::error_code&,
+                                              std::size_t){});
+}
+
+void Client::write_packet(buf_ptr pbuf, Peer& peer, const Packet& pkt) {
+  uint64_t gen_id = pkt.compact ? gen_id_ : pkt.gen_id;
+
+  if (gen_id != gen_id_) {
+    BRIDGE_TRACE(replay_drop, pkt.seq, pkt.len);
+    return;
+  }
+
+  ++rx_cnt_;
+  pipeline_.stage<Stats>().received(pkt);
+
+  if (pkt.control) {
+    control_handler(peer, pkt.data(), pkt.len);
+    return;
+  }
+
+  BRIDGE_TRACE(tun_write, pkt.seq, pkt.len);
+  if (handler_) {
+    PacketView view = unframe_packet(pkt.data(), pkt.len);
+    handler_(view.data, view.len);
+    return;
+  }
+
+  boost::asio::async_write(fd_,
+                           boost::asio::buffer(pkt.data(), pkt.len),
+                           [this, pbuf](const boost::system::error_code&,
+                                        std::size_t){});
+}
+
+void Client::handshake_handler(const boost::system::error_code& ec) {
   if (ec) {
     if (ec == boost::system::errc::operation_canceled) {
       return;
     }
-    LOG(WARNING) << "client read error: " << ec.message() << " (" << ec << ")";
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    LOG(WARNING) << "client timer error: " << ec.message() << " (" << ec << ")";
   }
 
-  start_reading();
+  if (std::all_of(peers_.begin(), peers_.end(),
+                  [](const Peer& peer) { return peer.session_idx != 0; })) {
+    start_keepalive();
+    return;
+  }
 
-  if (!ec) {
-    std::size_t data_offst = crypto_header_len;
-    std::size_t data_len = nbytes;
-#if defined(__APPLE__)
-    if (pbuf->at(data_offst + 0) != 0 || pbuf->at(data_offst + 1) != 0
-        || pbuf->at(data_offst + 2) != 0 || pbuf->at(data_offst + 3) != 2) {
-      // Family != IP
-      return;
+  if (--hello_left_ > 0) {
+    start_handshake();
+    return;
+  }
+  for (const Peer& peer : peers_) {
+    if (!peer.session_idx) {
+      LOG(INFO) << "server " << peer.addr << " does not support compact headers";
     }
-    data_offst += 4;
-    data_len -= 4;
-#endif
+  }
+  start_keepalive();
+}
 
-    Encryptor encryptor(client_id_, pbuf->data(), pbuf->size());
-    if (!encryptor.encrypt(gen_id_, ++tx_cnt_, data_offst, data_len)) {
-      --tx_cnt_;
+void Client::keepalive_handler(const boost::system::error_code& ec) {
+  if (ec) {
+    if (ec == boost::system::errc::operation_canceled) {
       return;
     }
+    LOG(WARNING) << "client timer error: " << ec.message() << " (" << ec << ")";
+  }
 
-    socket_.async_send(boost::asio::buffer(pbuf->data() + data_offst, data_len),
-                       [this, pbuf](const boost::system::error_code&,
-                                    std::size_t){});
+  uint64_t now = steady_us();
+  for (Peer& peer : peers_) {
+    if (peer.session_idx && now - peer.welcome_us > session_timeout_us) {
+      // The server no longer knows the index and drops compact headers.
+      LOG(INFO) << "client(" << gen_id_ << ") session " << peer.session_idx
+        << " with " << peer.addr << " lost, back to full headers";
+      peer.session_idx = 0;
+    }
+    send_control(peer, control_hello, 0);
   }
+  start_keepalive();
 }
 
-void Client::receive_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                             std::size_t nbytes) {
+void Client::probe_handler(const boost::system::error_code& ec) {
   if (ec) {
     if (ec == boost::system::errc::operation_canceled) {
       return;
     }
-    LOG(WARNING) << "client receive error: " << ec.message() << " (" << ec << ")";
+    LOG(WARNING) << "client timer error: " << ec.message() << " (" << ec << ")";
   }
 
-  start_receiving();
-
-  if (!ec) {
-    std::size_t data_offst = 0;
-    std::size_t data_len = nbytes;
-    uint64_t gen_id = 0;
-    uint64_t pkt_seq = 0;
+  uint64_t now = steady_us();
+  for (Peer& peer : peers_) {
+    uint64_t timeout = std::clamp(peer.srtt_us * 4, min_probe_timeout_us,
+                                  max_probe_timeout_us);
+    if (peer.probe_us && now - peer.probe_us > timeout) {
+      peer.record(false);
+    }
+  }
+  select_peer(now);
 
-    Decryptor decryptor(client_id_, pbuf->data() + data_offst, data_len);
-    if (!decryptor.decrypt(gen_id, pkt_seq, data_offst, data_len)) {
-      return;
+  for (std::size_t i = 0; i < peers_.size(); ++i) {
+    Peer& peer = peers_[i];
+    if (peer.probe_us || now < peer.next_probe_us) {
+      continue;
     }
+    peer.probe_us = now;
+    peer.next_probe_us = now + (i == active_ ? active_probe_interval_us
+                                             : probe_interval_us);
+    send_control(peer, control_probe, ++peer.probe_seq, now);
+  }
+  start_probing();
+}
 
-    if (gen_id != gen_id_) {
-      return;
+void Client::feedback_handler() {
+  const Stats& stats = pipeline_.stage<Stats>();
+  if (stats.rx_pkts != reported_rx_pkts_) {
+    reported_rx_pkts_ = stats.rx_pkts;
+    send_control(peers_[active_], control_rate, 0, stats.rx_bytes,
+                 stats.rx_pkts);
+  }
+  start_feedback();
+}
+
+void Client::select_peer(uint64_t now) {
+  std::size_t best = active_;
+  for (std::size_t i = 0; i < peers_.size(); ++i) {
+    if (peers_[i].score() < peers_[best].score()) {
+      best = i;
     }
+  }
 
-    ++rx_cnt_;
+  // Leave a server that is not down only for a clearly better one, and
+  // not again right after a switch.
+  const Peer& cur = peers_[active_];
+  const Peer& next = peers_[best];
+  if (best == active_ || next.down()
+      || (!cur.down() && (next.score() * 4 > cur.score() * 3
+                          || next.probes < history_len
+                          || now - switched_us_ < hold_down_us_))) {
+    return;
+  }
 
-#if defined(__APPLE__)
-    data_offst -= 4;
-    data_len += 4;
-    pbuf->at(data_offst + 0) = 0;
-    pbuf->at(data_offst + 1) = 0;
-    pbuf->at(data_offst + 2) = 0;
-    pbuf->at(data_offst + 3) = 2;
-#endif
+  LOG(INFO) << "client(" << gen_id_ << ") switched from " << cur.addr
+    << " to " << next.addr << ", rtt=" << next.srtt_us << "us, lost="
+    << next.lost() << "/" << std::min(next.probes, history_len);
+  active_ = best;
+  hold_down_us_ = switched_us_ && now - switched_us_ < flap_window_us
+    ? std::min(hold_down_us_ * 2, max_hold_down_us) : min_hold_down_us;
+  switched_us_ = now;
+  // Probe the new server at the active rate from now on.
+  peers_[best].next_probe_us = now;
+  pacer_->restart();
+}
+
+void Client::control_handler(Peer& peer, const uint8_t* data,
+                             std::size_t len) {
+  Control ctrl;
+  if (!unpack_control(data, len, ctrl)) {
+    return;
+  }
 
-    boost::asio::async_write(fd_,
-                             boost::asio::buffer(pbuf->data() + data_offst, data_len),
-                             [this, pbuf](const boost::system::error_code&,
-                                          std::size_t){});
+  switch (ctrl.type) {
+    case control_welcome:
+      if (ctrl.arg) {
+        peer.welcome_us = steady_us();
+      }
+      if (ctrl.arg && ctrl.arg != peer.session_idx) {
+        peer.session_idx = ctrl.arg;
+        LOG(INFO) << "client(" << gen_id_ << ") session " << peer.session_idx
+          << " with " << peer.addr;
+      }
+      break;
+    case control_probe_reply:
+      if (ctrl.arg == peer.probe_seq && peer.probe_us) {
+        uint64_t rtt = steady_us() - ctrl.val0;
+        peer.srtt_us = peer.srtt_us ? (peer.srtt_us * 7 + rtt) / 8 : rtt;
+        peer.record(true);
+      }
+      break;
+    case control_rate:
+      if (&peer == &peers_[active_]) {
+        pacer_->feedback(ctrl.val0, ctrl.val1);
+      }
+      break;
+    default:
+      break;
   }
 }
+
+void Client::send_control(Peer& peer, uint8_t type, uint32_t arg,
+                          uint64_t val0, uint64_t val1) {
+  buf_ptr pbuf = std::make_shared<buf_type>();
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = crypto_header_len;
+  pkt.len = control_len;
+  pkt.gen_id = gen_id_;
+  pkt.seq = ++tx_cnt_;
+
+  Control ctrl;
+  ctrl.type = type;
+  ctrl.arg = arg;
+  ctrl.val0 = val0;
+  ctrl.val1 = val1;
+  pack_control(pkt.data(), ctrl);
+
+  // Skip the platform header, control messages never had one, and leave
+  // session_idx 0 as the peer may not know its index yet.
+  if (!pipeline_.stage<CryptoPipeline>().stage<Cipher>().outbound(pkt)
+      || !pipeline_.stage<Stats>().outbound(pkt)) {
+    --tx_cnt_;
+    return;
+  }
+
+  send_packet(pbuf, peer.addr, pkt);
+}
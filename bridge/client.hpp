@@ -9,40 +9,132 @@
 #define client_hpp
 
 #include <array>
+#include <chrono>
 #include <memory>
 #include <string>
-#include <boost/asio.hpp>
+#include <vector>
+#include "asio_compat.hpp"
+#include "impair.hpp"
+#include "options.hpp"
+#include "pacer.hpp"
+#include "ordered_queue.hpp"
+#include "packet_io.hpp"
+#include "pipeline.hpp"
+#include "timer_wheel.hpp"
 
 namespace bridge {
 
 class Client {
  public:
+  // ip may list several servers separated by commas, all on the same port.
+  // The client then probes every one of them and sends to the best.
   explicit Client(boost::asio::io_context& io, const std::string& ip,
-                  const std::string& port, uint32_t client_id);
+                  const std::string& port, uint32_t client_id,
+                  const Options& opts, PacketHandler handler = nullptr);
   virtual ~Client();
 
   void start();
 
+  // With a handler no TUN device is opened: inner packets are injected
+  // here and handed to the handler instead of being written to TUN.
+  // Must be called on the io_context thread.
+  void submit(const PacketView* pkts, std::size_t n);
+
  private:
   using buf_type = std::array<uint8_t, 4096>;
   using buf_ptr = std::shared_ptr<buf_type>;
+  using addr_type = boost::asio::ip::udp::endpoint;
+
+  struct Peer {
+    addr_type addr;
+    // Assigned by this server, 0 until then or if it only speaks v1.
+    uint32_t session_idx = 0;
+    // When this server last confirmed session_idx, in steady microseconds.
+    uint64_t welcome_us = 0;
+    // Smoothed probe round trip in microseconds, 0 before the first reply.
+    uint64_t srtt_us = 0;
+    // Number of the last probe sent, when it was sent if it is still
+    // unanswered, and when the next one is due, in steady microseconds.
+    uint32_t probe_seq = 0;
+    uint64_t probe_us = 0;
+    uint64_t next_probe_us = 0;
+    // Outcome of the last probes, newest in bit 0, 1 is answered.
+    uint16_t history = 0;
+    unsigned probes = 0;
+
+    // Settle the outstanding probe.
+    void record(bool answered);
 
-  void start_reading();
-  void start_receiving();
-  void read_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                    std::size_t nbytes);
-  void receive_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                       std::size_t nbytes);
+    // Unanswered probes among the last window ones.
+    unsigned lost(unsigned window = 16) const;
+    // Never answered, or lost too many of the recent probes.
+    bool down() const;
+    uint64_t score() const;
+  };
+
+  // Each loop keeps one read in flight; start() runs io_depth of each.
+  // A read loop backs off on its own timer, so that one failing reader
+  // never cuts short another's wait.
+  boost::asio::awaitable<void> read_loop(boost::asio::steady_timer& timer);
+  boost::asio::awaitable<void> receive_loop();
+  void start_handshake();
+  void start_keepalive();
+  void start_probing();
+  void start_feedback();
+  Peer* find_peer(const addr_type& addr);
+  void receive_packet(buf_ptr pbuf, const addr_type& addr, std::size_t nbytes);
+  void forward_packet(buf_ptr pbuf, std::size_t nbytes);
+  void send_packet(buf_ptr pbuf, const addr_type& addr, const Packet& pkt);
+  void transmit(const Datagram& dgram);
+  void write_packet(buf_ptr pbuf, Peer& peer, const Packet& pkt);
+  void handshake_handler(const boost::system::error_code& ec);
+  void keepalive_handler(const boost::system::error_code& ec);
+  void probe_handler(const boost::system::error_code& ec);
+  void feedback_handler();
+  void select_peer(uint64_t now);
+  void control_handler(Peer& peer, const uint8_t* data, std::size_t len);
+  void send_control(Peer& peer, uint8_t type, uint32_t arg,
+                    uint64_t val0 = 0, uint64_t val1 = 0);
 
   boost::asio::io_context& io_;
   std::string ifname_;
   boost::asio::posix::stream_descriptor fd_;
   boost::asio::ip::udp::socket socket_;
+  boost::asio::steady_timer timer_;
+  boost::asio::steady_timer probe_timer_;
+  // Delay the next TUN read after an error, one per read loop. Not on
+  // the wheel, the read loops co_await them.
+  std::vector<boost::asio::steady_timer> backoff_timers_;
+  // Drives the rate reports, the pacer and the impairment.
+  TimerWheel wheel_;
+  TimerWheel::Timer feedback_timer_;
+  unsigned io_depth_;
   uint32_t client_id_;
+  PacketHandler handler_;
+  TunnelPipeline pipeline_;
   uint64_t gen_id_;
+  std::vector<Peer> peers_;
+  // Index of the peer we send to, when we last switched and how long
+  // until we may switch again without a failure, in steady microseconds.
+  std::size_t active_ = 0;
+  uint64_t switched_us_ = 0;
+  uint64_t hold_down_us_ = 0;
+  int hello_left_ = 5;
   uint64_t tx_cnt_ = 0;
   uint64_t rx_cnt_ = 0;
 
+  // Shapes and accounts for what we send, unshaped unless configured.
+  std::unique_ptr<Pacer> pacer_;
+  uint64_t reported_rx_pkts_ = 0;
+  // Only for testing, shapes what we send.
+  std::unique_ptr<Impairment> impair_;
+
+  // Only with crypto workers, the pool is declared last so that its
+  // threads are joined before the queues go away.
+  std::unique_ptr<OrderedQueue> tx_queue_;
+  std::unique_ptr<OrderedQueue> rx_queue_;
+  std::unique_ptr<boost::asio::thread_pool> pool_;
+
   Client(const Client&) = delete;
   Client& operator=(const Client&) = delete;
 };
@@ -0,0 +1,95 @@
+//
+//  control.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef control_hpp
+#define control_hpp
+
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+
+namespace bridge {
+
+// Tunnel control messages travel as inner packets whose IP version nibble
+// is 0, so a peer that does not understand them just hands them to TUN,
+// where the kernel drops them.
+//
+// Layout: type(1) reserved(3) arg(4) val0(8) val1(8), big endian.
+constexpr std::size_t control_len = 24;
+
+enum ControlType : uint8_t {
+  // client -> server, ask for a session index.
+  control_hello = 0x01,
+  // server -> client, arg is the session index for compact headers.
+  control_welcome = 0x02,
+  // client -> server, arg numbers the probe, val0 is the client's send time.
+  control_probe = 0x03,
+  // server -> client, echoes arg and val0 of a probe.
+  control_probe_reply = 0x04,
+  // either way, val0 and val1 are the bytes and datagrams received so far,
+  // sent every rate_report_interval while traffic flows.
+  control_rate = 0x05,
+};
+
+constexpr std::chrono::milliseconds rate_report_interval(200);
+
+struct Control {
+  uint8_t type = 0;
+  uint32_t arg = 0;
+  uint64_t val0 = 0;
+  uint64_t val1 = 0;
+};
+
+inline bool is_control(const uint8_t* p, std::size_t len) {
+  return len > 0 && (p[0] >> 4) == 0;
+}
+
+inline void pack_control(uint8_t* p, const Control& c) {
+  p[0] = c.type;
+  p[1] = p[2] = p[3] = 0;
+  for (int i = 0; i < 4; ++i) {
+    p[4 + i] = (uint8_t) (c.arg >> (24 - 8 * i));
+  }
+  for (int i = 0; i < 8; ++i) {
+    p[8 + i] = (uint8_t) (c.val0 >> (56 - 8 * i));
+    p[16 + i] = (uint8_t) (c.val1 >> (56 - 8 * i));
+  }
+}
+
+inline bool unpack_control(const uint8_t* p, std::size_t len, Control& c) {
+  if (len < control_len || !is_control(p, len)) {
+    return false;
+  }
+  c.type = p[0];
+  c.arg = 0;
+  c.val0 = 0;
+  c.val1 = 0;
+  for (int i = 0; i < 4; ++i) {
+    c.arg = (c.arg << 8) | p[4 + i];
+  }
+  for (int i = 0; i < 8; ++i) {
+    c.val0 = (c.val0 << 8) | p[8 + i];
+    c.val1 = (c.val1 << 8) | p[16 + i];
+  }
+  return true;
+}
+
+// Rebuild a 64-bit sequence from its lower 32 bits,
+// picking the candidate closest to the highest sequence seen so far.
+inline uint64_t expand_seq(uint32_t pkt_seq_lo, uint64_t ref) {
+  uint64_t seq = (ref & ~(uint64_t) 0xffffffff) | pkt_seq_lo;
+  if (seq + 0x80000000 < ref && seq < UINT64_MAX - 0xffffffff) {
+    seq += 0x100000000;
+  } else if (seq > ref + 0x80000000 && seq >= 0x100000000) {
+    seq -= 0x100000000;
+  }
+  return seq;
+}
+
+}
+
+#endif /* control_hpp */
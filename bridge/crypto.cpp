@@ -54,6 +54,25 @@ static uint64_t unpack64(const uint8_t* buf) {
   return val;
 }
 
+// A full header always satisfies (word0 ^ word1) == client_id,
+// a compact one never does, so both can share a socket.
+static bool is_full_header(const uint8_t* p, uint32_t client_id) {
+  return (unpack32(p) ^ unpack32(p + 4)) == client_id;
+}
+
+static uint32_t compact_seq_key(uint32_t client_id) {
+  return client_id ^ 0x5bd1e995;
+}
+
+static uint32_t compact_idx_key(uint32_t client_id, uint32_t pkt_seq_lo) {
+  return client_id ^ (pkt_seq_lo * 0x9e3779b1);
+}
+
+static uint8_t compact_data_key(uint32_t client_id, uint32_t pkt_seq_lo) {
+  uint32_t key = (client_id ^ pkt_seq_lo) * 0x85ebca6b;
+  return (uint8_t) ((key >> 24) ^ 0x5a);
+}
+
 CryptoBase::CryptoBase(uint32_t client_id, uint8_t* buf, std::size_t len)
     : client_id_(client_id), buf_(buf), len_(len) { }
 
@@ -115,6 +134,41 @@ bool Encryptor::encrypt(uint64_t gen_id, uint64_t pkt_seq,
   return true;
 }
 
+bool Encryptor::encrypt_compact(uint32_t session_idx, uint64_t pkt_seq,
+                                std::size_t& data_offst,
+                                std::size_t& data_len) {
+  if (!buf_ || len_ < (crypto_compact_header_len + data_len)) {
+    return false;
+  }
+
+  if (data_offst < crypto_compact_header_len) {
+    return false;
+  }
+
+  uint8_t* p = buf_ + data_offst - crypto_compact_header_len;
+
+  uint32_t pkt_seq_lo = (uint32_t) pkt_seq;
+  pack32(p, session_idx ^ compact_idx_key(client_id_, pkt_seq_lo));
+  pack32(p + 4, pkt_seq_lo ^ compact_seq_key(client_id_));
+  if (is_full_header(p, client_id_)) {
+    return false;
+  }
+  p += crypto_compact_header_len;
+
+  uint8_t x = compact_data_key(client_id_, pkt_seq_lo);
+  for (std::size_t i = 0; i < data_len; ++i) {
+    p[i] ^= x;
+    if ((i % 4) == 0) {
+      x += 19;
+    }
+  }
+
+  data_offst -= crypto_compact_header_len;
+  data_len += crypto_compact_header_len;
+
+  return true;
+}
+
 Decryptor::Decryptor(uint32_t client_id, uint8_t* buf, std::size_t len)
     : CryptoBase(client_id, buf, len) { }
 
@@ -129,14 +183,11 @@ bool Decryptor::decrypt(uint64_t& gen_id, uint64_t& pkt_seq,
   uint8_t* p = buf_;
 
   uint32_t rand = unpack32(p);
-  p += 4;
-
-  uint32_t client_id = unpack32(p);
-  p += 4;
 
-  if ((client_id ^ rand) != client_id_) {
+  if (!is_full_header(p, client_id_)) {
     return false;
   }
+  p += 8;
 
   uint64_t x1 = (uint64_t) rand << 32;
   x1 |= (uint64_t) client_id_;
@@ -163,3 +214,53 @@ bool Decryptor::decrypt(uint64_t& gen_id, uint64_t& pkt_seq,
 
   return true;
 }
+
+uint64_t Decryptor::peek_seq() const {
+  if (!buf_ || len_ < crypto_compact_header_len) {
+    return 0;
+  }
+  if (!is_full_header(buf_, client_id_)) {
+    return unpack32(buf_ + 4) ^ compact_seq_key(client_id_);
+  }
+  if (len_ < crypto_header_len) {
+    return 0;
+  }
+  uint64_t x2 = (uint64_t) client_id_ << 32;
+  x2 |= (uint64_t) unpack32(buf_);
+  x2 ^= 0x96834d5e32017c65;
+  return unpack64(buf_ + 16) ^ x2;
+}
+
+bool Decryptor::decrypt_compact(uint32_t session_idx, uint32_t& pkt_seq_lo,
+                                std::size_t& data_offst,
+                                std::size_t& data_len) {
+  if (!buf_ || len_ < crypto_compact_header_len) {
+    return false;
+  }
+
+  uint8_t* p = buf_;
+
+  if (is_full_header(p, client_id_)) {
+    return false;
+  }
+
+  uint32_t seq_lo = unpack32(p + 4) ^ compact_seq_key(client_id_);
+  if ((unpack32(p) ^ compact_idx_key(client_id_, seq_lo)) != session_idx) {
+    return false;
+  }
+  p += crypto_compact_header_len;
+
+  pkt_seq_lo = seq_lo;
+  data_offst = crypto_compact_header_len;
+  data_len = len_ - crypto_compact_header_len;
+
+  uint8_t x = compact_data_key(client_id_, seq_lo);
+  for (std::size_t i = 0; i < data_len; ++i) {
+    p[i] ^= x;
+    if ((i % 4) == 0) {
+      x += 19;
+    }
+  }
+
+  return true;
+}
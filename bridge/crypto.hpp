@@ -14,11 +14,13 @@
 namespace bridge {
 
 constexpr std::size_t crypto_header_len = 24;
+// Header used once a session index has been negotiated, see control.hpp.
+constexpr std::size_t crypto_compact_header_len = 8;
 
 class CryptoBase {
  public:
   explicit CryptoBase(uint32_t client_id, uint8_t* buf, std::size_t len);
-  virtual ~CryptoBase();
+  ~CryptoBase();
 
  protected:
   uint32_t client_id_;
@@ -29,19 +31,34 @@ class CryptoBase {
 class Encryptor : public CryptoBase {
  public:
   explicit Encryptor(uint32_t client_id, uint8_t* buf, std::size_t len);
-  virtual ~Encryptor();
+  ~Encryptor();
 
   bool encrypt(uint64_t gen_id, uint64_t pkt_seq,
                std::size_t& data_offst, std::size_t& data_len);
+
+  // Fail if the compact header would pass for a full one,
+  // the caller should then send this packet with encrypt().
+  bool encrypt_compact(uint32_t session_idx, uint64_t pkt_seq,
+                       std::size_t& data_offst, std::size_t& data_len);
 };
 
 class Decryptor : public CryptoBase {
  public:
   explicit Decryptor(uint32_t client_id, uint8_t* buf, std::size_t len);
-  virtual ~Decryptor();
+  ~Decryptor();
 
   bool decrypt(uint64_t& gen_id, uint64_t& pkt_seq,
                std::size_t& data_offst, std::size_t& data_len);
+
+  // Only the lower 32 bits of the sequence are carried,
+  // use expand_seq() to recover the rest.
+  bool decrypt_compact(uint32_t session_idx, uint32_t& pkt_seq_lo,
+                       std::size_t& data_offst, std::size_t& data_len);
+
+  // The sequence number from the header alone, for tracing before the
+  // packet is decrypted. Lower 32 bits only for compact headers, 0 if
+  // the packet is too short.
+  uint64_t peek_seq() const;
 };
 
 }
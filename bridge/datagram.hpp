@@ -0,0 +1,36 @@
+//
+//  datagram.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef datagram_hpp
+#define datagram_hpp
+
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <functional>
+#include <memory>
+#include "asio_compat.hpp"
+
+namespace bridge {
+
+// An encrypted datagram on its way to the outer socket. It holds a
+// reference to its buffer, so the pacer and the impairment can park it
+// on a timer as plain data instead of capturing it in a closure.
+struct Datagram {
+  std::shared_ptr<void> owner;
+  const uint8_t* data = nullptr;
+  std::size_t len = 0;
+  boost::asio::ip::udp::endpoint addr;
+  // Departure time for SO_TXTIME (CLOCK_MONOTONIC ns), 0 sends now.
+  uint64_t txtime = 0;
+};
+
+// The next step for a datagram, set once when the owner is built.
+using DatagramSink = std::function<void(const Datagram&)>;
+
+}
+
+#endif /* datagram_hpp */
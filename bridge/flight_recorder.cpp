@@ -0,0 +1,83 @@
+//
+//  flight_recorder.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "flight_recorder.hpp"
+
+using namespace bridge;
+
+namespace {
+
+std::mutex registry_mutex;
+std::vector<const FlightRecorder*> registry;
+
+// Reference point taken at start-up to turn clock ticks into microseconds.
+const uint64_t start_clock = trace_clock();
+const std::chrono::steady_clock::time_point start_time =
+  std::chrono::steady_clock::now();
+
+const char* event_name(uint8_t event) {
+  switch (event) {
+    case trace_tun_read: return "tun_read";
+    case trace_encrypt: return "encrypt";
+    case trace_send: return "send";
+    case trace_receive: return "receive";
+    case trace_decrypt: return "decrypt";
+    case trace_decrypt_fail: return "decrypt_fail";
+    case trace_replay_drop: return "replay_drop";
+    case trace_tun_write: return "tun_write";
+    case trace_acl_drop: return "acl_drop";
+    case trace_queue_drop: return "queue_drop";
+    default: return "unknown";
+  }
+}
+
+}
+
+FlightRecorder::FlightRecorder()
+    : thread_id_(std::hash<std::thread::id>()(std::this_thread::get_id())) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.push_back(this);
+}
+
+FlightRecorder::~FlightRecorder() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.erase(std::remove(registry.begin(), registry.end(), this),
+                 registry.end());
+}
+
+void FlightRecorder::dump(std::ostream& os) {
+  uint64_t ticks = trace_clock() - start_clock;
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>
+    (std::chrono::steady_clock::now() - start_time).count();
+
+  os << "# ticks_per_us " << (us ? (double) ticks / us : 0.0) << "\n";
+  os << "# thread clock seq len event\n";
+
+  // Holding the lock keeps exiting threads from freeing their ring.
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const FlightRecorder* recorder : registry) {
+    recorder->dump_ring(os);
+  }
+}
+
+void FlightRecorder::dump_ring(std::ostream& os) const {
+  uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t tail = head > capacity ? head - capacity : 0;
+
+  for (uint64_t i = tail; i < head; ++i) {
+    const Record& r = ring_[i & (capacity - 1)];
+    uint64_t clock = r.clock.load(std::memory_order_relaxed);
+    uint64_t info = r.info.load(std::memory_order_relaxed);
+    os << thread_id_ << ' ' << clock << ' ' << (info >> 24) << ' '
+      << ((info >> 8) & 0xffff) << ' ' << event_name(info & 0xff) << "\n";
+  }
+}
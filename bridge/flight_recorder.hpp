@@ -0,0 +1,92 @@
+//
+//  flight_recorder.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef flight_recorder_hpp
+#define flight_recorder_hpp
+
+#include <atomic>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <ostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace bridge {
+
+enum TraceEvent : uint8_t {
+  trace_tun_read = 1,
+  trace_encrypt,
+  trace_send,
+  trace_receive,
+  trace_decrypt,
+  trace_decrypt_fail,
+  trace_replay_drop,
+  trace_tun_write,
+  trace_acl_drop,
+  trace_queue_drop,
+};
+
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Always-on per-thread ring of compact packet events.
+// Only the owning thread writes its ring; dump() may read every ring at
+// any time without stopping the writers, at the price of possibly seeing
+// a torn record for the slot being overwritten at that moment.
+class FlightRecorder {
+ public:
+  static constexpr std::size_t capacity = 8192;
+
+  // The calling thread's recorder, registered on first use.
+  static FlightRecorder& local() {
+    static thread_local FlightRecorder recorder;
+    return recorder;
+  }
+
+  void record(TraceEvent event, uint64_t seq, std::size_t len) {
+    uint64_t i = head_.load(std::memory_order_relaxed);
+    Record& r = ring_[i & (capacity - 1)];
+    r.clock.store(trace_clock(), std::memory_order_relaxed);
+    r.info.store((seq << 24) | ((len & 0xffff) << 8) | event,
+                 std::memory_order_relaxed);
+    head_.store(i + 1, std::memory_order_release);
+  }
+
+  // Write all rings as text, oldest event first per thread.
+  static void dump(std::ostream& os);
+
+ private:
+  // clock: tsc (or ns), info: seq(40) len(16) event(8).
+  struct Record {
+    std::atomic<uint64_t> clock{0};
+    std::atomic<uint64_t> info{0};
+  };
+
+  FlightRecorder();
+  ~FlightRecorder();
+
+  void dump_ring(std::ostream& os) const;
+
+  std::atomic<uint64_t> head_{0};
+  Record ring_[capacity];
+  uint64_t thread_id_;
+
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+};
+
+}
+
+#endif /* flight_recorder_hpp */
@@ -0,0 +1,285 @@
+//
+//  handoff.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "handoff.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// Layout, big endian:
+// magic(4) version(4) client_id(4) session_idx(4) gen_id(8) rx_seq(8)
+// tx_cnt(8) idle_minutes(8) active(1) family(1) port(2) addr(16) ifname(16)
+constexpr uint32_t handoff_magic = 0x4252484f; // "BRHO"
+constexpr uint32_t handoff_version = 3;
+constexpr std::size_t handoff_len = 84;
+constexpr std::size_t ifname_len = 16;
+
+void put(uint8_t*& p, uint64_t v, int bytes) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    *p++ = (uint8_t) (v >> (8 * i));
+  }
+}
+
+uint64_t get(const uint8_t*& p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i) {
+    v = (v << 8) | *p++;
+  }
+  return v;
+}
+
+void pack_state(uint8_t* buf, const HandoffState& s) {
+  uint8_t* p = buf;
+  put(p, handoff_magic, 4);
+  put(p, handoff_version, 4);
+  put(p, s.client_id, 4);
+  put(p, s.session_idx, 4);
+  put(p, s.gen_id, 8);
+  put(p, s.rx_seq, 8);
+  put(p, s.tx_cnt, 8);
+  put(p, s.idle_minutes, 8);
+  put(p, s.active, 1);
+
+  const boost::asio::ip::address& addr = s.client_addr.address();
+  put(p, addr.is_v6() ? 6 : 4, 1);
+  put(p, s.client_addr.port(), 2);
+  memset(p, 0, 16);
+  if (addr.is_v6()) {
+    auto bytes = addr.to_v6().to_bytes();
+    memcpy(p, bytes.data(), bytes.size());
+  } else {
+    auto bytes = addr.to_v4().to_bytes();
+    memcpy(p, bytes.data(), bytes.size());
+  }
+  p += 16;
+
+  memset(p, 0, ifname_len);
+  memcpy(p, s.ifname.data(), std::min(s.ifname.size(), ifname_len - 1));
+}
+
+void unpack_state(const uint8_t* buf, HandoffState& s) {
+  const uint8_t* p = buf;
+  if (get(p, 4) != handoff_magic || get(p, 4) != handoff_version) {
+    throw std::runtime_error("handoff from an incompatible server");
+  }
+  s.client_id = (uint32_t) get(p, 4);
+  s.session_idx = (uint32_t) get(p, 4);
+  s.gen_id = get(p, 8);
+  s.rx_seq = get(p, 8);
+  s.tx_cnt = get(p, 8);
+  s.idle_minutes = get(p, 8);
+  s.active = get(p, 1) != 0;
+
+  uint8_t family = (uint8_t) get(p, 1);
+  uint16_t port = (uint16_t) get(p, 2);
+  if (family == 6) {
+    boost::asio::ip::address_v6::bytes_type bytes;
+    memcpy(bytes.data(), p, bytes.size());
+    s.client_addr = {boost::asio::ip::address_v6(bytes), port};
+  } else {
+    boost::asio::ip::address_v4::bytes_type bytes;
+    memcpy(bytes.data(), p, bytes.size());
+    s.client_addr = {boost::asio::ip::address_v4(bytes), port};
+  }
+  p += 16;
+
+  s.ifname.assign((const char*) p, strnlen((const char*) p, ifname_len));
+}
+
+sockaddr_un unix_addr(const std::string& path) {
+  sockaddr_un sun;
+  memset(&sun, 0, sizeof(sun));
+  if (path.size() >= sizeof(sun.sun_path)) {
+    throw std::runtime_error("handoff path too long: " + path);
+  }
+  sun.sun_family = AF_UNIX;
+  memcpy(sun.sun_path, path.c_str(), path.size());
+  return sun;
+}
+
+#if defined(MSG_NOSIGNAL)
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0;
+#endif
+
+}
+
+void bridge::pack_request(uint8_t* buf, uint32_t client_id) {
+  uint8_t* p = buf;
+  put(p, handoff_magic, 4);
+  put(p, handoff_version, 4);
+  put(p, client_id, 4);
+}
+
+bool bridge::unpack_request(const uint8_t* buf, uint32_t& client_id) {
+  const uint8_t* p = buf;
+  if (get(p, 4) != handoff_magic || get(p, 4) != handoff_version) {
+    return false;
+  }
+  client_id = (uint32_t) get(p, 4);
+  return true;
+}
+
+bool bridge::peer_trusted(int conn) {
+#if defined(SO_PEERCRED)
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    return false;
+  }
+  uid_t uid = cred.uid;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(conn, &uid, &gid) < 0) {
+    return false;
+  }
+#endif
+  return uid == 0 || uid == geteuid();
+}
+
+int bridge::take_over(const std::string& path, uint32_t client_id,
+                      int& tun_fd, int& udp_fd, HandoffState& state) {
+  sockaddr_un sun = unix_addr(path);
+  int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn < 0) {
+    throw std::runtime_error(std::string("handoff socket: ") + strerror(errno));
+  }
+  if (connect(conn, (const sockaddr*) &sun, sizeof(sun)) < 0) {
+    int err = errno;
+    close(conn);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return -1;
+    }
+    throw std::runtime_error("handoff connect " + path + ": " + strerror(err));
+  }
+  if (!peer_trusted(conn)) {
+    close(conn);
+    throw std::runtime_error("handoff socket " + path
+                             + " is served by another user");
+  }
+
+  // Don't hang forever on a wedged predecessor.
+  timeval tv = {5, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  uint8_t req[handoff_request_len];
+  pack_request(req, client_id);
+  if (send(conn, req, sizeof(req), send_flags) != (ssize_t) sizeof(req)) {
+    int err = errno;
+    close(conn);
+    throw std::runtime_error("handoff request failed: "
+                             + std::string(strerror(err)));
+  }
+
+  uint8_t buf[handoff_len];
+  union {
+    cmsghdr hdr;
+    uint8_t buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  iovec iov = {buf, sizeof(buf)};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  ssize_t n = recvmsg(conn, &msg, MSG_WAITALL);
+  int err = errno;
+
+  int fds[2] = {-1, -1};
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (n > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS
+      && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  }
+  if (n != (ssize_t) handoff_len || fds[0] < 0 || fds[1] < 0
+      || (msg.msg_flags & MSG_CTRUNC)) {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    close(conn);
+    if (n == 0) {
+      // The old server closes without a word if it refuses us.
+      throw std::runtime_error("handoff refused by the server at " + path
+                               + ", is its client_id the same?");
+    }
+    throw std::runtime_error("handoff receive failed: "
+                             + std::string(n < 0 ? strerror(err)
+                                           : "short message"));
+  }
+
+  try {
+    unpack_state(buf, state);
+  } catch (...) {
+    close(fds[0]);
+    close(fds[1]);
+    close(conn);
+    throw;
+  }
+  tun_fd = fds[0];
+  udp_fd = fds[1];
+  return conn;
+}
+
+void bridge::confirm_take_over(int conn) {
+  uint8_t ready = handoff_ready;
+  if (send(conn, &ready, 1, send_flags) != 1) {
+    throw std::runtime_error("handoff confirm failed: "
+                             + std::string(strerror(errno)));
+  }
+  uint8_t go = 0;
+  ssize_t n = recv(conn, &go, 1, 0);
+  if (n != 1 || go != handoff_go) {
+    throw std::runtime_error("the previous server kept the session: "
+                             + std::string(n < 0 ? strerror(errno)
+                                           : "no go-ahead"));
+  }
+}
+
+bool bridge::hand_off(int conn, int tun_fd, int udp_fd,
+                      const HandoffState& state) {
+  uint8_t buf[handoff_len];
+  pack_state(buf, state);
+
+  union {
+    cmsghdr hdr;
+    uint8_t buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  iovec iov = {buf, sizeof(buf)};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int fds[2] = {tun_fd, udp_fd};
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  return sendmsg(conn, &msg, send_flags) == (ssize_t) handoff_len;
+}
@@ -0,0 +1,72 @@
+//
+//  handoff.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef handoff_hpp
+#define handoff_hpp
+
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <string>
+#include "asio_compat.hpp"
+
+namespace bridge {
+
+// What a server needs to carry on a session without the client noticing.
+struct HandoffState {
+  uint32_t client_id = 0;
+  std::string ifname;
+  boost::asio::ip::udp::endpoint client_addr;
+  uint64_t gen_id = 0;
+  uint64_t rx_seq = 0;
+  uint64_t tx_cnt = 0;
+  uint32_t session_idx = 0;
+  // Whole minutes since the client was last heard from.
+  uint64_t idle_minutes = 0;
+  bool active = false;
+};
+
+// Hot restart: a new server process connects to the old one's Unix socket,
+// sends a request naming its client_id and receives the TUN and UDP fds
+// (SCM_RIGHTS) together with the session state. Once it has set itself up
+// around them it answers handoff_ready, and only takes over when the old
+// server answers handoff_go; if it fails or stays silent the old server
+// carries on. Both fds stay open in the kernel throughout, so nothing
+// queued on them is lost. Either side only deals with processes of its
+// own user or root.
+
+// magic(4) version(4) client_id(4), big endian.
+constexpr std::size_t handoff_request_len = 12;
+constexpr uint8_t handoff_ready = 'R';
+constexpr uint8_t handoff_go = 'G';
+
+void pack_request(uint8_t* buf, uint32_t client_id);
+// Return false if buf is not a request from a compatible server.
+bool unpack_request(const uint8_t* buf, uint32_t& client_id);
+
+// Return true if the process at the other end of a Unix socket runs as
+// our effective user or as root.
+bool peer_trusted(int conn);
+
+// Connect to path and receive the fds and state from the server listening
+// there. Return -1 if nobody listens, else the connection to pass to
+// confirm_take_over() once everything that can fail is done. Closing it
+// instead hands the session back. Throw exceptions on a broken or refused
+// handoff.
+int take_over(const std::string& path, uint32_t client_id,
+              int& tun_fd, int& udp_fd, HandoffState& state);
+
+// Tell the old server we are ready and wait for it to stand down.
+// Throw exceptions if it does not, it then keeps the session.
+void confirm_take_over(int conn);
+
+// Send both fds and the state over a connected Unix socket.
+// Return false on failure, the caller then still owns everything.
+bool hand_off(int conn, int tun_fd, int udp_fd, const HandoffState& state);
+
+}
+
+#endif /* handoff_hpp */
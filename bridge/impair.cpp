@@ -0,0 +1,169 @@
+//
+//  impair.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <glog/logging.h>
+#include "impair.hpp"
+
+using namespace bridge;
+
+namespace {
+
+double parse_number(const std::string& key, const std::string& s,
+                    double max) {
+  char* end = nullptr;
+  double v = strtod(s.c_str(), &end);
+  if (s.empty() || *end || !(v >= 0 && v <= max)) {
+    throw std::runtime_error("bad impairment value " + key + "=" + s);
+  }
+  return v;
+}
+
+std::chrono::steady_clock::duration parse_ms(const std::string& key,
+                                             const std::string& s) {
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double, std::milli>(parse_number(key, s, 60000)));
+}
+
+}
+
+Impairment::Impairment(TimerWheel& wheel, const std::string& spec,
+                       DatagramSink send)
+    : wheel_(wheel),
+      send_(std::move(send)),
+      rng_(std::random_device()()),
+      report_at_(clock::now() + std::chrono::seconds(60)) {
+  std::istringstream ss(spec);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    std::size_t eq = item.find('=');
+    if (eq == std::string::npos) {
+      throw std::runtime_error("bad impairment " + item);
+    }
+    std::string key = item.substr(0, eq);
+    std::string val = item.substr(eq + 1);
+
+    if (key == "loss") {
+      loss_ = parse_number(key, val, 100) / 100;
+    } else if (key == "ge") {
+      std::istringstream vs(val);
+      std::string p, r, h = "100";
+      if (!std::getline(vs, p, ':') || !std::getline(vs, r, ':')) {
+        throw std::runtime_error("bad impairment " + item);
+      }
+      std::getline(vs, h, ':');
+      ge_p_ = parse_number(key, p, 100) / 100;
+      ge_r_ = parse_number(key, r, 100) / 100;
+      ge_h_ = parse_number(key, h, 100) / 100;
+    } else if (key == "delay") {
+      delay_ = parse_ms(key, val);
+    } else if (key == "jitter") {
+      jitter_ = parse_ms(key, val);
+    } else if (key == "reorder") {
+      reorder_ = parse_number(key, val, 100) / 100;
+    } else if (key == "dup") {
+      dup_ = parse_number(key, val, 100) / 100;
+    } else if (key == "rate") {
+      rate_ = parse_number(key, val, 100e6) * 1000 / 8;
+    } else {
+      throw std::runtime_error("unknown impairment " + key);
+    }
+  }
+
+  LOG(INFO) << "link impairment enabled: " << spec;
+}
+
+Impairment::~Impairment() {
+}
+
+void Impairment::submit(const Datagram& dgram) {
+  clock::time_point now = clock::now();
+  if (now >= report_at_) {
+    report(now);
+  }
+
+  if (lost()) {
+    ++dropped_;
+    return;
+  }
+
+  clock::duration after = clock::duration::zero();
+  if (rate_ > 0) {
+    busy_until_ = std::max(busy_until_, now);
+    if (busy_until_ - now > std::chrono::seconds(1)) {
+      ++tail_dropped_;
+      return;
+    }
+    busy_until_ += std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(dgram.len / rate_));
+    after = busy_until_ - now;
+  }
+
+  if (reorder_ > 0 && unit_(rng_) < reorder_) {
+    ++reordered_;
+  } else {
+    after += delay();
+  }
+
+  ++passed_;
+  transmit(after, dgram);
+  if (dup_ > 0 && unit_(rng_) < dup_) {
+    ++duplicated_;
+    transmit(after, dgram);
+  }
+}
+
+bool Impairment::lost() {
+  if (ge_p_ > 0) {
+    ge_bad_ = unit_(rng_) < (ge_bad_ ? 1 - ge_r_ : ge_p_);
+    if (ge_bad_ && unit_(rng_) < ge_h_) {
+      return true;
+    }
+  }
+  return loss_ > 0 && unit_(rng_) < loss_;
+}
+
+Impairment::clock::duration Impairment::delay() {
+  if (jitter_ == clock::duration::zero()) {
+    return delay_;
+  }
+  std::uniform_int_distribution<clock::rep> dist(-jitter_.count(),
+                                                 jitter_.count());
+  return std::max(delay_ + clock::duration(dist(rng_)),
+                  clock::duration::zero());
+}
+
+void Impairment::transmit(clock::duration after, const Datagram& dgram) {
+  if (after <= clock::duration::zero()) {
+    send_(dgram);
+    return;
+  }
+
+  if (free_.empty()) {
+    slots_.emplace_back(new Slot());
+    free_.push_back(slots_.back().get());
+  }
+  Slot* slot = free_.back();
+  free_.pop_back();
+  slot->dgram = dgram;
+  // Two pointers fit std::function's inline storage, nothing is allocated.
+  wheel_.schedule(slot->timer, after, [this, slot] {
+    send_(slot->dgram);
+    slot->dgram.owner.reset();
+    free_.push_back(slot);
+  });
+}
+
+void Impairment::report(clock::time_point now) {
+  LOG(INFO) << "impairment: passed=" << passed_ << ", dropped=" << dropped_
+            << ", tail_dropped=" << tail_dropped_ << ", reordered="
+            << reordered_ << ", duplicated=" << duplicated_;
+  report_at_ = now + std::chrono::seconds(60);
+}
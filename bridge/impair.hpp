@@ -0,0 +1,102 @@
+//
+//  impair.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef impair_hpp
+#define impair_hpp
+
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "asio_compat.hpp"
+#include "datagram.hpp"
+#include "timer_wheel.hpp"
+
+namespace bridge {
+
+// Link impairment emulator for the outer UDP path, for testing only.
+// The spec is a comma separated list of
+//   loss=<pct>          independent random loss
+//   ge=<p>:<r>[:<h>]    Gilbert-Elliott burst loss: good->bad <p>%,
+//                       bad->good <r>%, loss in the bad state <h>% (100)
+//   delay=<ms>          fixed one-way delay
+//   jitter=<ms>         uniform +-jitter on top of the delay
+//   reorder=<pct>       send this share immediately, ahead of the delayed
+//                       rest (needs a delay, like netem)
+//   dup=<pct>           send a second copy
+//   rate=<kbit>         serialization rate, tail drop beyond 1s of backlog
+// e.g. "loss=1,delay=20,jitter=5,rate=10000".
+// Throw exceptions on a malformed spec.
+class Impairment {
+ public:
+  explicit Impairment(TimerWheel& wheel, const std::string& spec,
+                      DatagramSink send);
+  virtual ~Impairment();
+
+  // Pass one datagram through the emulated link: it reaches send zero,
+  // one or two times, now or later on the io thread.
+  void submit(const Datagram& dgram);
+
+  // Delayed datagrams not sent yet.
+  std::size_t pending() const { return slots_.size() - free_.size(); }
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  bool lost();
+  clock::duration delay();
+  void transmit(clock::duration after, const Datagram& dgram);
+  void report(clock::time_point now);
+
+  // A delayed datagram and its timer.
+  struct Slot {
+    TimerWheel::Timer timer;
+    Datagram dgram;
+  };
+
+  TimerWheel& wheel_;
+  DatagramSink send_;
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> unit_{0.0, 1.0};
+
+  double loss_ = 0;
+  double ge_p_ = 0;
+  double ge_r_ = 0;
+  double ge_h_ = 1;
+  bool ge_bad_ = false;
+  clock::duration delay_{0};
+  clock::duration jitter_{0};
+  double reorder_ = 0;
+  double dup_ = 0;
+  // Bytes per second, 0 is unlimited.
+  double rate_ = 0;
+  // When the emulated link finishes sending what is queued.
+  clock::time_point busy_until_;
+
+  // Slots of delayed datagrams in flight and the ones free for reuse;
+  // the pool only grows to the most ever in flight at once.
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::vector<Slot*> free_;
+
+  clock::time_point report_at_;
+  uint64_t passed_ = 0;
+  uint64_t dropped_ = 0;
+  uint64_t tail_dropped_ = 0;
+  uint64_t reordered_ = 0;
+  uint64_t duplicated_ = 0;
+
+  Impairment(const Impairment&) = delete;
+  Impairment& operator=(const Impairment&) = delete;
+};
+
+}
+
+#endif /* impair_hpp */
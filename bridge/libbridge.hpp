@@ -0,0 +1,31 @@
+//
+//  libbridge.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef libbridge_hpp
+#define libbridge_hpp
+
+// Public header of libbridge.a (make lib).
+//
+// Embed the tunnel engine without a TUN device: construct a Client or
+// Server with a PacketHandler, feed it raw inner IP packets in batches
+// with submit() and receive decrypted ones through the handler, e.g.
+//
+//   boost::asio::io_context io;
+//   bridge::Client c(io, "1.2.3.4", "5555", client_id, bridge::Options(),
+//                    [](const uint8_t* data, std::size_t len) { ... });
+//   c.start();
+//   c.submit(pkts, n);  // on the io thread
+//   io.run();
+//
+// Both submit() and the handler run on the io_context thread.
+
+#include "client.hpp"
+#include "options.hpp"
+#include "packet_io.hpp"
+#include "server.hpp"
+
+#endif /* libbridge_hpp */
@@ -5,36 +5,144 @@
 //  Created by 冀宸 on 2022/2/1.
 //
 
+#include <cerrno>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <memory>
+#include <sstream>
 #include <string>
-#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glog/logging.h>
+#include "asio_compat.hpp"
+#include "async_log.hpp"
+#include "busy_poll.hpp"
 #include "client.hpp"
+#include "flight_recorder.hpp"
+#include "options.hpp"
 #include "server.hpp"
 
-void client_start(boost::asio::io_context& io, const std::string& ip,
-                  const std::string& port, uint32_t client_id) {
-  static bridge::Client c(io, ip, port, client_id);
-  c.start();
+// Write the flight recorder to a new file in $RUNTIME_DIRECTORY, else
+// $TMPDIR or /tmp. We usually run as root, so never follow or reuse an
+// existing path there.
+static void dump_trace() {
+  static unsigned dumps = 0;
+  std::string dir;
+  for (const char* env : {"RUNTIME_DIRECTORY", "TMPDIR"}) {
+    const char* val = getenv(env);
+    if (val && *val) {
+      // systemd may list several directories.
+      dir = std::string(val).substr(0, std::string(val).find(':'));
+      break;
+    }
+  }
+  if (dir.empty()) {
+    dir = "/tmp";
+  }
+  std::string path = dir + "/bridge-" + std::to_string(getpid()) + "-"
+    + std::to_string(++dumps) + ".trace";
+
+  int fd = open(path.c_str(),
+                O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    LOG(WARNING) << "flight recorder dump to " << path << " failed: "
+      << strerror(errno);
+    return;
+  }
+  std::ostringstream os;
+  bridge::FlightRecorder::dump(os);
+  std::string text = os.str();
+  const char* p = text.data();
+  std::size_t left = text.size();
+  while (left) {
+    ssize_t n = write(fd, p, left);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG(WARNING) << "flight recorder dump to " << path << " failed: "
+        << strerror(errno);
+      close(fd);
+      return;
+    }
+    p += n;
+    left -= n;
+  }
+  close(fd);
+  LOG(INFO) << "flight recorder dumped to " << path;
+}
+
+// SIGUSR1 dumps the flight recorder for post-mortem latency analysis.
+static void wait_dump_signal(boost::asio::signal_set& signals) {
+  signals.async_wait([&signals](const boost::system::error_code& ec, int) {
+    if (ec) {
+      return;
+    }
+    dump_trace();
+    wait_dump_signal(signals);
+  });
 }
 
-void server_start(boost::asio::io_context& io, const std::string& ip,
-                  const std::string& port, uint32_t client_id) {
-  static bridge::Server s(io, ip, port, client_id);
-  s.start();
+static void usage() {
+  LOG(ERROR) << "Usage: ./bridge [-s] [-c cpu] [-b spin_us] [-w workers] [-d depth]"
+    " [-p kbit|auto] [-e] [-a acl_file] [-i impair] [-r handoff_path] ip port client_id";
+  exit(EXIT_FAILURE);
 }
 
 int main(int argc, char* argv[]) {
-  if ((argc != 4 && argc != 5) || (argc == 5 && strcmp(argv[1], "-s"))) {
-    LOG(ERROR) << "Usage: ./bridge [-s] ip port client_id";
-    exit(EXIT_FAILURE);
+  bool server = false;
+  bridge::Options opts;
+
+  int ch;
+  while ((ch = getopt(argc, argv, "sc:b:w:d:p:ea:i:r:")) != -1) {
+    switch (ch) {
+      case 's':
+        server = true;
+        break;
+      case 'c':
+        opts.cpu = atoi(optarg);
+        break;
+      case 'b':
+        opts.busy_poll_us = (unsigned) atol(optarg);
+        break;
+      case 'w':
+        opts.crypto_workers = (unsigned) atol(optarg);
+        break;
+      case 'd':
+        opts.io_depth = (unsigned) atol(optarg);
+        break;
+      case 'p':
+        if (std::string(optarg) == "auto") {
+          opts.pace_auto = true;
+        } else {
+          opts.pace_kbit = (unsigned) atol(optarg);
+        }
+        break;
+      case 'e':
+        opts.pace_edt = true;
+        break;
+      case 'a':
+        opts.acl_file = optarg;
+        break;
+      case 'i':
+        opts.impair = optarg;
+        break;
+      case 'r':
+        opts.handoff_path = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (argc - optind != 3) {
+    usage();
   }
 
-  bool server = (argc == 5) ? true : false;
-  const char *ip = argv[argc - 3];
-  const char *port = argv[argc - 2];
-  uint32_t client_id = (uint32_t) atol(argv[argc - 1]);
+  const char *ip = argv[optind];
+  const char *port = argv[optind + 1];
+  uint32_t client_id = (uint32_t) atol(argv[optind + 2]);
   if (client_id == 0 || client_id == UINT32_MAX) {
     LOG(ERROR) << "invalid client_id";
     exit(EXIT_FAILURE);
@@ -42,12 +150,33 @@ int main(int argc, char* argv[]) {
 
   try {
     boost::asio::io_context io;
+    boost::asio::signal_set signals(io, SIGUSR1);
+    wait_dump_signal(signals);
+    // Declared after io so they are gone before it, e.g. once a server
+    // handed off and stopped io.
+    std::unique_ptr<bridge::Server> s;
+    std::unique_ptr<bridge::Client> c;
     if (server) {
-      server_start(io, ip, port, client_id);
+      s = std::make_unique<bridge::Server>(io, ip, port, client_id, opts);
+      s->start();
+    } else {
+      c = std::make_unique<bridge::Client>(io, ip, port, client_id, opts);
+      c->start();
+    }
+    // Threads inherit the mask of their creator, so pin only once the
+    // crypto workers and the log backend are running.
+    if (opts.cpu >= 0) {
+      bridge::start_log_backend();
+      bridge::pin_thread(opts.cpu);
+    }
+    bridge::WakeupProbe probe(io, opts.busy_poll_us ? "busy-poll" : "reactor");
+    probe.start();
+    if (opts.busy_poll_us) {
+      bridge::BusyPoller poller(io, opts.busy_poll_us);
+      poller.run();
     } else {
-      client_start(io, ip, port, client_id);
+      io.run();
     }
-    io.run();
   } catch (std::exception& e) {
     LOG(ERROR) << e.what();
     exit(EXIT_FAILURE);
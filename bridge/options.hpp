@@ -0,0 +1,40 @@
+//
+//  options.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef options_hpp
+#define options_hpp
+
+#include <string>
+
+namespace bridge {
+
+struct Options {
+  // Pin the I/O thread to this core, -1 leaves scheduling to the OS.
+  int cpu = -1;
+  // Busy-poll spin budget in microseconds, 0 disables busy-poll mode.
+  unsigned busy_poll_us = 0;
+  // Concurrent reads kept outstanding on TUN and on the socket each.
+  unsigned io_depth = 1;
+  // Threads running the cipher, 0 keeps it on the io thread.
+  unsigned crypto_workers = 0;
+  // Inner packet ACL rule file, see acl.hpp. Empty allows everything.
+  std::string acl_file;
+  // Pace the outer socket at this rate, 0 is off unless pace_auto.
+  unsigned pace_kbit = 0;
+  // Pace at the delivery rate the peer reports.
+  bool pace_auto = false;
+  // Let the kernel hold paced packets (SO_TXTIME), needs fq or etf.
+  bool pace_edt = false;
+  // Outer link impairment spec for testing, see impair.hpp. Empty is off.
+  std::string impair;
+  // Unix socket for hot restart, see handoff.hpp. Server only, empty is off.
+  std::string handoff_path;
+};
+
+}
+
+#endif /* options_hpp */
@@ -0,0 +1,112 @@
+//
+//  ordered_queue.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include "ordered_queue.hpp"
+
+using namespace bridge;
+
+OrderedQueue::OrderedQueue(boost::asio::io_context& io,
+                           boost::asio::thread_pool& pool, unsigned workers,
+                           work_type work, done_type done)
+    : io_(io),
+      pool_(pool),
+      workers_(std::max(workers, 1u)),
+      work_(std::move(work)),
+      done_(std::move(done)),
+      slots_(new Slot[capacity]) { }
+
+OrderedQueue::~OrderedQueue() { }
+
+bool OrderedQueue::submit(Job job) {
+  if (tail_ - head_ >= capacity) {
+    return false;
+  }
+
+  uint64_t ticket = tail_++;
+  slots_[ticket % capacity].job = std::move(job);
+  published_.store(tail_);
+
+  // Wake another worker only while fewer than workers_ are busy, the busy
+  // ones pick the slot up with their next batch.
+  unsigned active = active_.load();
+  while (active < workers_) {
+    if (active_.compare_exchange_weak(active, active + 1)) {
+      boost::asio::post(pool_, [this]() { work(); });
+      break;
+    }
+  }
+
+  return true;
+}
+
+// Take an even share of the unclaimed slots, at least one.
+bool OrderedQueue::claim(uint64_t& begin, uint64_t& end) {
+  begin = claimed_.load();
+  for (;;) {
+    uint64_t avail = published_.load() - begin;
+    if (!avail) {
+      return false;
+    }
+    uint64_t n = std::clamp<uint64_t>((avail + workers_ - 1) / workers_,
+                                      1, max_batch);
+    end = begin + n;
+    if (claimed_.compare_exchange_weak(begin, end)) {
+      return true;
+    }
+  }
+}
+
+void OrderedQueue::work() {
+  for (;;) {
+    uint64_t begin;
+    uint64_t end;
+    while (claim(begin, end)) {
+      for (uint64_t ticket = begin; ticket != end; ++ticket) {
+        Slot& slot = slots_[ticket % capacity];
+        slot.ok = work_(slot.job.pkt);
+        slot.ready.store(true, std::memory_order_release);
+      }
+      // One pending drain picks up every slot that is ready by the time it
+      // runs.
+      if (!drain_pending_.exchange(true, std::memory_order_acq_rel)) {
+        boost::asio::post(io_, [this]() { drain(); });
+      }
+    }
+
+    // Leave, unless a slot was published after the last claim and its
+    // submit saw this worker still busy.
+    active_.fetch_sub(1);
+    if (claimed_.load() == published_.load()) {
+      return;
+    }
+    unsigned active = active_.load();
+    do {
+      if (active >= workers_) {
+        return;
+      }
+    } while (!active_.compare_exchange_weak(active, active + 1));
+  }
+}
+
+void OrderedQueue::drain() {
+  drain_pending_.store(false, std::memory_order_release);
+
+  while (head_ != tail_) {
+    Slot& slot = slots_[head_ % capacity];
+    if (!slot.ready.load(std::memory_order_acquire)) {
+      break;
+    }
+    slot.ready.store(false, std::memory_order_relaxed);
+    ++head_;
+
+    Job job = std::move(slot.job);
+    if (slot.ok) {
+      done_(job);
+    }
+  }
+}
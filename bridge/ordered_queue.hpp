@@ -0,0 +1,89 @@
+//
+//  ordered_queue.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef ordered_queue_hpp
+#define ordered_queue_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "asio_compat.hpp"
+#include "pipeline.hpp"
+
+namespace bridge {
+
+// Serial queue of one peer and direction.
+// Packets are transformed on a worker pool in parallel, but completions are
+// handed back on the io thread in submission order, so the inner transport
+// never sees reordering introduced by the workers.
+class OrderedQueue {
+ public:
+  // A packet and what its completion needs, kept in the ticket slot as
+  // plain data instead of in a closure.
+  struct Job {
+    Packet pkt;
+    // Keeps pkt.buf alive.
+    std::shared_ptr<void> owner;
+    boost::asio::ip::udp::endpoint addr;
+  };
+
+  // Runs on a worker, return false to drop the packet.
+  using work_type = std::function<bool(Packet&)>;
+  // Runs on the io thread, only for jobs the work accepted.
+  using done_type = std::function<void(Job&)>;
+
+  // At most workers threads of the pool work on this queue at a time.
+  explicit OrderedQueue(boost::asio::io_context& io,
+                        boost::asio::thread_pool& pool, unsigned workers,
+                        work_type work, done_type done);
+  virtual ~OrderedQueue();
+
+  // Must be called on the io thread.
+  // Return false if too many packets are in flight.
+  bool submit(Job job);
+
+  // Packets submitted but not handed back yet, io thread only.
+  std::size_t size() const { return tail_ - head_; }
+
+ private:
+  static constexpr std::size_t capacity = 1024;
+  // Most slots a worker claims at once.
+  static constexpr uint64_t max_batch = 32;
+
+  struct Slot {
+    Job job;
+    bool ok = false;
+    std::atomic<bool> ready{false};
+  };
+
+  void work();
+  bool claim(uint64_t& begin, uint64_t& end);
+  void drain();
+
+  boost::asio::io_context& io_;
+  boost::asio::thread_pool& pool_;
+  const unsigned workers_;
+  work_type work_;
+  done_type done_;
+  std::unique_ptr<Slot[]> slots_;
+  // Next ticket to deliver and next ticket to hand out, io thread only.
+  uint64_t head_ = 0;
+  uint64_t tail_ = 0;
+  // Tickets whose slot is filled in, and the next one for a worker.
+  std::atomic<uint64_t> published_{0};
+  std::atomic<uint64_t> claimed_{0};
+  std::atomic<unsigned> active_{0};
+  std::atomic<bool> drain_pending_{false};
+
+  OrderedQueue(const OrderedQueue&) = delete;
+  OrderedQueue& operator=(const OrderedQueue&) = delete;
+};
+
+}
+
+#endif /* ordered_queue_hpp */
@@ -0,0 +1,215 @@
+//
+//  pacer.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <glog/logging.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#endif
+#include "pacer.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// Never queue more than this much, tail drop beyond.
+constexpr std::chrono::seconds max_backlog(1);
+// Autorate never paces below 1 Mbit/s ...
+constexpr double min_auto_rate = 1e6 / 8;
+// ... and leaves headroom above the best delivery rate seen.
+constexpr double auto_gain = 1.25;
+
+}
+
+Pacer::Pacer(TimerWheel& wheel, int fd, unsigned rate_kbit, bool autorate,
+             bool edt, DatagramSink send)
+    : wheel_(wheel),
+      send_(std::move(send)),
+      autorate_(autorate),
+      rate_(rate_kbit * 1000.0 / 8),
+      period_start_(clock::now()) {
+  if (edt && (rate_kbit || autorate)) {
+#if defined(SO_TXTIME)
+    sock_txtime cfg;
+    cfg.clockid = CLOCK_MONOTONIC;
+    cfg.flags = 0;
+    edt_ = setsockopt(fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+#else
+    (void) fd;
+#endif
+    if (!edt_) {
+      LOG(WARNING) << "SO_TXTIME unavailable, pacing with a user-space timer";
+    }
+  }
+  if (rate_kbit || autorate) {
+    LOG(INFO) << "pacing at " << (autorate ? "the delivery rate"
+                                  : std::to_string(rate_kbit) + " kbit/s")
+      << (edt_ ? " with SO_TXTIME" : " with a user-space timer");
+  }
+}
+
+Pacer::~Pacer() {
+}
+
+void Pacer::submit(const Datagram& dgram) {
+  clock::time_point now = clock::now();
+  if (now - period_start_ >= std::chrono::seconds(60)) {
+    report(now);
+  }
+
+  if (rate_ <= 0) {
+    ++tx_pkts_;
+    tx_bytes_ += dgram.len;
+    send_(dgram);
+    return;
+  }
+
+  // Unused credit is kept for one burst of 1ms or two full datagrams.
+  double burst = std::max(rate_ / 1000, 3000.0);
+  clock::time_point earliest = now - std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(burst / rate_));
+  next_ = std::max(next_, earliest);
+  if (next_ - now > max_backlog) {
+    ++dropped_;
+    return;
+  }
+
+  clock::time_point departure = std::max(next_, now);
+  next_ += std::chrono::duration_cast<clock::duration>(
+    std::chrono::duration<double>(dgram.len / rate_));
+  ++tx_pkts_;
+  tx_bytes_ += dgram.len;
+
+  if (departure <= now) {
+    send_(dgram);
+    return;
+  }
+  ++delayed_;
+
+  if (edt_) {
+    // steady_clock is CLOCK_MONOTONIC, the clock SO_TXTIME was set up with.
+    Datagram timed = dgram;
+    timed.txtime = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (departure.time_since_epoch()).count();
+    send_(timed);
+    return;
+  }
+
+  if (free_.empty()) {
+    slots_.emplace_back(new Slot());
+    free_.push_back(slots_.back().get());
+  }
+  Slot* slot = free_.back();
+  free_.pop_back();
+  slot->dgram = dgram;
+  wheel_.schedule(slot->timer, departure - now, [this, slot] {
+    send_(slot->dgram);
+    slot->dgram.owner.reset();
+    free_.push_back(slot);
+  });
+}
+
+void Pacer::feedback(uint64_t rx_bytes, uint64_t rx_pkts) {
+  clock::time_point now = clock::now();
+  if (has_feedback_ && rx_pkts >= peer_rx_pkts_ && rx_bytes >= peer_rx_bytes_) {
+    uint64_t delivered_bytes = rx_bytes - peer_rx_bytes_;
+    uint64_t delivered_pkts = rx_pkts - peer_rx_pkts_;
+    timed_delivered_bytes_ += delivered_bytes;
+    timed_delivered_pkts_ += delivered_pkts;
+    timed_sent_pkts_ += tx_pkts_ - feedback_tx_pkts_;
+
+    double secs = std::chrono::duration<double>(now - feedback_at_).count();
+    if (autorate_ && secs > 0) {
+      update_rate(delivered_bytes / secs);
+    }
+  }
+
+  has_feedback_ = true;
+  feedback_at_ = now;
+  feedback_tx_pkts_ = tx_pkts_;
+  peer_rx_bytes_ = rx_bytes;
+  peer_rx_pkts_ = rx_pkts;
+}
+
+void Pacer::restart() {
+  has_feedback_ = false;
+}
+
+void Pacer::update_rate(double delivered) {
+  samples_[sample_idx_++ % samples_.size()] = delivered;
+  double best = *std::max_element(samples_.begin(), samples_.end());
+  rate_ = std::max(best * auto_gain, min_auto_rate);
+}
+
+void Pacer::report(clock::time_point now) {
+  double secs = std::chrono::duration<double>(now - period_start_).count();
+  std::ostringstream os;
+  os << "pacing: rate=";
+  if (rate_ > 0) {
+    os << (uint64_t) (rate_ * 8 / 1000) << "kbit/s";
+  } else {
+    os << "off";
+  }
+  os << ", sent=" << (uint64_t) ((tx_bytes_ - timed_tx_bytes_) * 8 / secs / 1000)
+     << "kbit/s, delivered=" << (uint64_t) (timed_delivered_bytes_ * 8 / secs / 1000)
+     << "kbit/s";
+  if (timed_sent_pkts_) {
+    uint64_t lost = timed_sent_pkts_ > timed_delivered_pkts_
+      ? timed_sent_pkts_ - timed_delivered_pkts_ : 0;
+    os << ", loss=" << (lost * 100.0 / timed_sent_pkts_) << "%";
+  }
+  os << ", delayed=" << delayed_ << ", dropped=" << dropped_;
+  LOG(INFO) << os.str();
+
+  period_start_ = now;
+  timed_tx_bytes_ = tx_bytes_;
+  timed_sent_pkts_ = 0;
+  timed_delivered_bytes_ = 0;
+  timed_delivered_pkts_ = 0;
+  delayed_ = 0;
+  dropped_ = 0;
+}
+
+bool bridge::send_at(int fd, const void* data, std::size_t len,
+                     const sockaddr* addr, socklen_t addrlen, uint64_t txtime) {
+#if defined(SO_TXTIME)
+  union {
+    cmsghdr hdr;
+    uint8_t buf[CMSG_SPACE(sizeof(uint64_t))];
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  iovec iov = {const_cast<void*>(data), len};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = const_cast<sockaddr*>(addr);
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+
+  return sendmsg(fd, &msg, 0) == (ssize_t) len;
+#else
+  (void) fd;
+  (void) data;
+  (void) len;
+  (void) addr;
+  (void) addrlen;
+  (void) txtime;
+  return false;
+#endif
+}
@@ -0,0 +1,106 @@
+//
+//  pacer.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef pacer_hpp
+#define pacer_hpp
+
+#include <array>
+#include <chrono>
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <functional>
+#include <memory>
+#include <vector>
+#include <sys/socket.h>
+#include "asio_compat.hpp"
+#include "datagram.hpp"
+#include "timer_wheel.hpp"
+
+namespace bridge {
+
+// Token-bucket shaper for the outer socket, plus delivery and loss
+// accounting from the peer's rate reports.
+// Packets due later are held on the owner's timer wheel, or with edt leave
+// at once with a departure time for the kernel (SO_TXTIME). Only ask for
+// edt with the fq or etf qdisc on the egress device, others send at once.
+// A rate of 0 without autorate only measures.
+class Pacer {
+ public:
+  explicit Pacer(TimerWheel& wheel, int fd, unsigned rate_kbit,
+                 bool autorate, bool edt, DatagramSink send);
+  virtual ~Pacer();
+
+  // Pass dgram on to send now, later, or now with a departure time.
+  void submit(const Datagram& dgram);
+
+  // Cumulative receive counters from the peer's latest rate report.
+  void feedback(uint64_t rx_bytes, uint64_t rx_pkts);
+
+  // Forget the last report, e.g. after switching to another peer.
+  void restart();
+
+  // Datagrams held on the wheel until their departure time.
+  std::size_t pending() const { return slots_.size() - free_.size(); }
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  void update_rate(double delivered);
+  void report(clock::time_point now);
+
+  // A held datagram and its timer.
+  struct Slot {
+    TimerWheel::Timer timer;
+    Datagram dgram;
+  };
+
+  TimerWheel& wheel_;
+  DatagramSink send_;
+  bool edt_ = false;
+  bool autorate_;
+  // Bytes per second, 0 sends unshaped.
+  double rate_ = 0;
+  // Departure time of the next byte, lagging now by at most one burst.
+  clock::time_point next_;
+
+  // Slots of held datagrams and the ones free for reuse.
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::vector<Slot*> free_;
+
+  // Delivery rate samples (bytes/s), autorate paces at their maximum.
+  std::array<double, 10> samples_{};
+  std::size_t sample_idx_ = 0;
+
+  uint64_t tx_bytes_ = 0;
+  uint64_t tx_pkts_ = 0;
+  // State at the last report.
+  bool has_feedback_ = false;
+  clock::time_point feedback_at_;
+  uint64_t feedback_tx_pkts_ = 0;
+  uint64_t peer_rx_bytes_ = 0;
+  uint64_t peer_rx_pkts_ = 0;
+
+  clock::time_point period_start_;
+  uint64_t timed_tx_bytes_ = 0;
+  uint64_t timed_sent_pkts_ = 0;
+  uint64_t timed_delivered_bytes_ = 0;
+  uint64_t timed_delivered_pkts_ = 0;
+  uint64_t delayed_ = 0;
+  uint64_t dropped_ = 0;
+
+  Pacer(const Pacer&) = delete;
+  Pacer& operator=(const Pacer&) = delete;
+};
+
+// sendmsg() with an SCM_TXTIME departure time.
+// Return false if it failed or EDT is unavailable.
+bool send_at(int fd, const void* data, std::size_t len,
+             const sockaddr* addr, socklen_t addrlen, uint64_t txtime);
+
+}
+
+#endif /* pacer_hpp */
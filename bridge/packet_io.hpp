@@ -0,0 +1,60 @@
+//
+//  packet_io.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef packet_io_hpp
+#define packet_io_hpp
+
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <cstring>
+#include <functional>
+#include <sys/socket.h>
+
+namespace bridge {
+
+// A raw inner IP packet handed in or out by the user-space packet API.
+struct PacketView {
+  const uint8_t* data;
+  std::size_t len;
+};
+
+// Receives inner packets in place of TUN. data points into the tunnel's
+// own buffer and is only valid during the call.
+using PacketHandler = std::function<void(const uint8_t* data, std::size_t len)>;
+
+// Length of the header the TUN device puts in front of every packet.
+#if defined(__APPLE__)
+constexpr std::size_t tun_frame_len = 4;
+#else
+constexpr std::size_t tun_frame_len = 0;
+#endif
+
+// Copy a raw packet to p, framed the way the TUN device would deliver it,
+// and return the framed length.
+inline std::size_t frame_packet(uint8_t* p, const PacketView& pkt) {
+#if defined(__APPLE__)
+  uint32_t family = (pkt.len && (pkt.data[0] >> 4) == 6) ? AF_INET6 : AF_INET;
+  p[0] = (uint8_t) (family >> 24);
+  p[1] = (uint8_t) (family >> 16);
+  p[2] = (uint8_t) (family >> 8);
+  p[3] = (uint8_t) family;
+#endif
+  memcpy(p + tun_frame_len, pkt.data, pkt.len);
+  return pkt.len + tun_frame_len;
+}
+
+// Strip the TUN framing again.
+inline PacketView unframe_packet(const uint8_t* p, std::size_t len) {
+  if (len < tun_frame_len) {
+    return PacketView{p, 0};
+  }
+  return PacketView{p + tun_frame_len, len - tun_frame_len};
+}
+
+}
+
+#endif /* packet_io_hpp */
@@ -0,0 +1,244 @@
+//
+//  pipeline.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef pipeline_hpp
+#define pipeline_hpp
+
+#include <cstddef> // std::size_t
+#include <cstdint> // uintx_t
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <sys/socket.h>
+#include "acl.hpp"
+#include "control.hpp"
+#include "crypto.hpp"
+#include "probes.hpp"
+
+namespace bridge {
+
+// A packet travelling through the pipeline.
+// [buf, buf + size) is the whole buffer, headroom included,
+// [buf + offst, buf + offst + len) is the current payload.
+struct Packet {
+  uint8_t* buf = nullptr;
+  std::size_t size = 0;
+  std::size_t offst = 0;
+  std::size_t len = 0;
+  uint64_t gen_id = 0;
+  uint64_t seq = 0;
+  // Session index for compact headers, 0 means full headers only.
+  uint32_t session_idx = 0;
+  // Set on inbound packets that had a compact header,
+  // seq then only holds the lower 32 bits.
+  bool compact = false;
+  // Set on inbound control messages, decided on the decrypted payload
+  // before any stage puts a TUN header in front.
+  bool control = false;
+
+  uint8_t* data() const { return buf + offst; }
+};
+
+// Stages are plain policy types with
+//   bool outbound(Packet&);  // TUN -> wire
+//   bool inbound(Packet&);   // wire -> TUN
+// Outbound runs the stages front to back, inbound back to front, and a
+// stage returning false drops the packet. Everything is resolved at
+// compile time, so a stage that is not listed costs nothing.
+template <typename... Stages>
+class Pipeline {
+ public:
+  template <typename... Args>
+  explicit Pipeline(Args&&... args) : stages_(std::forward<Args>(args)...) { }
+
+  bool outbound(Packet& pkt) {
+    return std::apply([&pkt](Stages&... s) {
+      return (s.outbound(pkt) && ...);
+    }, stages_);
+  }
+
+  bool inbound(Packet& pkt) {
+    return inbound<sizeof...(Stages)>(pkt);
+  }
+
+  template <typename Stage>
+  Stage& stage() { return std::get<Stage>(stages_); }
+
+  template <typename Stage>
+  const Stage& stage() const { return std::get<Stage>(stages_); }
+
+ private:
+  template <std::size_t I>
+  bool inbound(Packet& pkt) {
+    if constexpr (I == 0) {
+      return true;
+    } else {
+      return std::get<I - 1>(stages_).inbound(pkt) && inbound<I - 1>(pkt);
+    }
+  }
+
+  std::tuple<Stages...> stages_;
+};
+
+// utun prepends the 4-byte protocol family to every packet,
+// AF_INET or AF_INET6 in network byte order.
+class AppleFamilyHeader {
+ public:
+  bool outbound(Packet& pkt) {
+    const uint8_t* p = pkt.data();
+    if (pkt.len < 4) {
+      return false;
+    }
+    uint32_t family = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+      | ((uint32_t) p[2] << 8) | p[3];
+    if (family != AF_INET && family != AF_INET6) {
+      return false;
+    }
+    pkt.offst += 4;
+    pkt.len -= 4;
+    return true;
+  }
+
+  bool inbound(Packet& pkt) {
+    if (pkt.control || pkt.offst < 4) {
+      return true;
+    }
+    uint32_t family = (pkt.len && (pkt.data()[0] >> 4) == 6)
+      ? AF_INET6 : AF_INET;
+    pkt.offst -= 4;
+    pkt.len += 4;
+    uint8_t* p = pkt.data();
+    p[0] = (uint8_t) (family >> 24);
+    p[1] = (uint8_t) (family >> 16);
+    p[2] = (uint8_t) (family >> 8);
+    p[3] = (uint8_t) family;
+    return true;
+  }
+};
+
+class NoPlatformHeader {
+ public:
+  bool outbound(Packet&) { return true; }
+  bool inbound(Packet&) { return true; }
+};
+
+#if defined(__APPLE__)
+using PlatformHeader = AppleFamilyHeader;
+#else
+using PlatformHeader = NoPlatformHeader;
+#endif
+
+// Drop unwanted inner packets before they cost encryption or bandwidth,
+// and after decryption before they reach TUN. No table allows everything.
+class AclFilter {
+ public:
+  explicit AclFilter(std::shared_ptr<const Acl> acl) : acl_(std::move(acl)) { }
+
+  bool outbound(Packet& pkt) {
+    if (!acl_ || acl_->allow(false, pkt.data(), pkt.len)) {
+      return true;
+    }
+    BRIDGE_TRACE(acl_drop, pkt.seq, pkt.len);
+    return false;
+  }
+
+  bool inbound(Packet& pkt) {
+    if (!acl_ || pkt.control
+        || acl_->allow(true, pkt.data(), pkt.len)) {
+      return true;
+    }
+    BRIDGE_TRACE(acl_drop, pkt.seq, pkt.len);
+    return false;
+  }
+
+ private:
+  std::shared_ptr<const Acl> acl_;
+};
+
+// Obfuscation, compact header when the session has an index.
+class Cipher {
+ public:
+  explicit Cipher(uint32_t client_id) : client_id_(client_id) { }
+
+  bool outbound(Packet& pkt) {
+    Encryptor encryptor(client_id_, pkt.buf, pkt.size);
+    if ((!pkt.session_idx
+         || !encryptor.encrypt_compact(pkt.session_idx, pkt.seq,
+                                       pkt.offst, pkt.len))
+        && !encryptor.encrypt(pkt.gen_id, pkt.seq, pkt.offst, pkt.len)) {
+      return false;
+    }
+    BRIDGE_TRACE(encrypt, pkt.seq, pkt.len);
+    return true;
+  }
+
+  bool inbound(Packet& pkt) {
+    std::size_t data_offst = 0;
+    std::size_t data_len = pkt.len;
+    Decryptor decryptor(client_id_, pkt.data(), pkt.len);
+    if (decryptor.decrypt(pkt.gen_id, pkt.seq, data_offst, data_len)) {
+      pkt.compact = false;
+    } else {
+      uint32_t pkt_seq_lo = 0;
+      if (!pkt.session_idx
+          || !decryptor.decrypt_compact(pkt.session_idx, pkt_seq_lo,
+                                        data_offst, data_len)) {
+        BRIDGE_TRACE(decrypt_fail, 0, pkt.len);
+        return false;
+      }
+      pkt.seq = pkt_seq_lo;
+      pkt.compact = true;
+    }
+    pkt.offst += data_offst;
+    pkt.len = data_len;
+    pkt.control = is_control(pkt.data(), pkt.len);
+    BRIDGE_TRACE(decrypt, pkt.seq, pkt.len);
+    return true;
+  }
+
+ private:
+  uint32_t client_id_;
+};
+
+// Datagram and byte counters on the wire side.
+class Stats {
+ public:
+  bool outbound(Packet& pkt) {
+    ++tx_pkts;
+    tx_bytes += pkt.len;
+    return true;
+  }
+
+  // Inbound datagrams are counted by received() once they decrypted and
+  // passed the replay check, so forged ones cannot inflate the counters
+  // that feed the rate control.
+  bool inbound(Packet&) { return true; }
+
+  // Counts the datagram at its wire size, from the start of the buffer to
+  // the end of the data, which decryption leaves unchanged.
+  void received(const Packet& pkt) {
+    ++rx_pkts;
+    rx_bytes += pkt.offst + pkt.len;
+  }
+
+  uint64_t tx_pkts = 0;
+  uint64_t tx_bytes = 0;
+  uint64_t rx_pkts = 0;
+  uint64_t rx_bytes = 0;
+};
+
+// Stateless stages, safe to run on any thread.
+using CryptoPipeline = Pipeline<PlatformHeader, AclFilter, Cipher>;
+
+// Per-packet path shared by Client and Server. Pipelines are stages too,
+// so with crypto workers the inner CryptoPipeline runs on the pool while
+// Stats stays on the io thread.
+using TunnelPipeline = Pipeline<CryptoPipeline, Stats>;
+
+}
+
+#endif /* pipeline_hpp */
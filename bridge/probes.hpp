@@ -0,0 +1,34 @@
+//
+//  probes.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef probes_hpp
+#define probes_hpp
+
+#include "flight_recorder.hpp"
+
+// Static USDT probes, provider "bridge", arguments (seq, len).
+// They compile to a single nop until a tracer attaches, e.g.
+//   bpftrace -e 'usdt:./build/bridge.out:bridge:replay_drop { @[arg1] = count(); }'
+// Build with -DBRIDGE_NO_USDT to leave them out entirely.
+#if !defined(BRIDGE_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BRIDGE_PROBE(name, seq, len) DTRACE_PROBE2(bridge, name, seq, len)
+#endif
+#endif
+
+#if !defined(BRIDGE_PROBE)
+#define BRIDGE_PROBE(name, seq, len) do { } while (0)
+#endif
+
+// Fire the probe and log the event to the flight recorder.
+#define BRIDGE_TRACE(name, seq, len) do { \
+  BRIDGE_PROBE(name, seq, len); \
+  bridge::FlightRecorder::local().record(bridge::trace_##name, (seq), (len)); \
+} while (0)
+
+#endif /* probes_hpp */
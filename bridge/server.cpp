@@ -5,11 +5,24 @@
 //  Created by 冀宸 on 2022/2/3.
 //
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <functional>
-#include <thread>
+#include <random>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <glog/logging.h>
+#include "async_log.hpp"
+#include "busy_poll.hpp"
+#include "control.hpp"
 #include "crypto.hpp"
+#include "handoff.hpp"
+#include "pipeline.hpp"
+#include "probes.hpp"
+#include "scoped_fd.hpp"
 #include "server.hpp"
 
 #if defined(__APPLE__)
@@ -24,198 +37,710 @@ extern int tun_open(std::string& name);
 
 using namespace bridge;
 
+namespace {
+
+constexpr std::chrono::seconds stats_interval(60);
+// A session without packets for this long is dropped.
+constexpr std::chrono::minutes idle_timeout(5);
+// A successor must send its request, and confirm once it has the fds,
+// within this long.
+constexpr std::chrono::seconds handoff_timeout(5);
+// How long a server waits for its inbound to stop before a handoff.
+constexpr std::chrono::seconds settle_timeout(1);
+// How long a handed off server keeps sending what it still holds.
+constexpr std::chrono::seconds drain_timeout(2);
+
+}
+
 Server::Server(boost::asio::io_context& io, const std::string& ip,
-               const std::string& port, uint32_t client_id)
+               const std::string& port, uint32_t client_id,
+               const Options& opts, PacketHandler handler)
     : io_(io),
       ifname_(),
-      fd_(io, opentun(ifname_)),
+      fd_(io),
       socket_(io),
-      timer_(io),
-      client_id_(client_id) {
-  fd_.non_blocking(true);
+      wheel_(io),
+      io_depth_(std::max(opts.io_depth, 1u)),
+      handoff_acceptor_(io),
+      handoff_conn_(io),
+      client_id_(client_id),
+      handler_(std::move(handler)),
+      pipeline_(CryptoPipeline(PlatformHeader(),
+                               AclFilter(opts.acl_file.empty() ? nullptr
+                                         : Acl::load(opts.acl_file, client_id)),
+                               Cipher(client_id)),
+                Stats()) {
+  if (handler_ && !opts.handoff_path.empty()) {
+    throw std::runtime_error("hot restart needs a TUN device");
+  }
+  for (unsigned i = 0; i < io_depth_; ++i) {
+    backoff_timers_.emplace_back(io_);
+  }
+  // Bad options fail before take_over(), which holds up the old server
+  // until we confirm or give up.
+  if (!opts.impair.empty()) {
+    impair_ = std::make_unique<Impairment>(
+      wheel_, opts.impair, [this](const Datagram& dgram) { transmit(dgram); });
+  }
+  if (opts.crypto_workers) {
+    pool_ = std::make_unique<boost::asio::thread_pool>(opts.crypto_workers);
+    // Stats is not thread-safe, count once the packet is back in order.
+    tx_queue_ = std::make_unique<OrderedQueue>(
+      io_, *pool_, opts.crypto_workers,
+      [this](Packet& pkt) {
+        return pipeline_.stage<CryptoPipeline>().outbound(pkt);
+      },
+      [this](OrderedQueue::Job& job) {
+        pipeline_.stage<Stats>().outbound(job.pkt);
+        send_packet(std::static_pointer_cast<buf_type>(job.owner), job.pkt);
+      });
+    rx_queue_ = std::make_unique<OrderedQueue>(
+      io_, *pool_, opts.crypto_workers,
+      [this](Packet& pkt) {
+        return pipeline_.stage<CryptoPipeline>().inbound(pkt);
+      },
+      [this](OrderedQueue::Job& job) {
+        write_packet(std::static_pointer_cast<buf_type>(job.owner), job.addr,
+                     job.pkt);
+      });
+  }
   boost::asio::ip::udp::resolver resolver(io_);
   auto ep = *resolver.resolve(ip.c_str(), port.c_str()).begin();
-  socket_.open(ep.endpoint().protocol());
-  socket_.bind(ep.endpoint());
-  socket_.non_blocking(true);
-  timer_.expires_at(boost::asio::chrono::steady_clock::now());
 
-  LOG(INFO) << ifname_ << " is opened, fd=" << fd_.native_handle();
+  // Listen on a private path first and move it over the old one's at the
+  // end, so the old server stays reachable until we are up. Only our user
+  // may connect.
+  std::string listen_path;
+  if (!opts.handoff_path.empty()) {
+    listen_path = opts.handoff_path + "." + std::to_string(getpid());
+    unlink(listen_path.c_str());
+    boost::asio::local::stream_protocol::endpoint path(listen_path);
+    handoff_acceptor_.open(path.protocol());
+    handoff_acceptor_.bind(path);
+    if (chmod(listen_path.c_str(), 0600) < 0) {
+      unlink(listen_path.c_str());
+      throw std::runtime_error("handoff listen " + listen_path + ": "
+                               + strerror(errno));
+    }
+    handoff_acceptor_.listen();
+  }
+
+  HandoffState state;
+  bool resumed = false;
+  try {
+    // Everything from here to confirm_take_over() may still fail without
+    // harm: closing conn hands the session back to the old server.
+    ScopedFD conn;
+    int tun_fd = -1;
+    int udp_fd = -1;
+    if (!opts.handoff_path.empty()) {
+      conn.reset(take_over(opts.handoff_path, client_id, tun_fd, udp_fd,
+                           state));
+      resumed = conn.defined();
+      if (resumed && state.client_id != client_id) {
+        close(tun_fd);
+        close(udp_fd);
+        throw std::runtime_error("handoff from a server of another client_id");
+      }
+    }
+
+    if (!handler_) {
+      if (resumed) {
+        ifname_ = state.ifname;
+        fd_.assign(tun_fd);
+      } else {
+        fd_.assign(opentun(ifname_));
+      }
+      fd_.non_blocking(true);
+    }
+    if (resumed) {
+      socket_.assign(ep.endpoint().protocol(), udp_fd);
+    } else {
+      socket_.open(ep.endpoint().protocol());
+      socket_.bind(ep.endpoint());
+    }
+    socket_.non_blocking(true);
+
+    DatagramSink paced;
+    if (impair_) {
+      paced = [this](const Datagram& dgram) { impair_->submit(dgram); };
+    } else {
+      paced = [this](const Datagram& dgram) { transmit(dgram); };
+    }
+    pacer_ = std::make_unique<Pacer>(wheel_, socket_.native_handle(),
+                                     opts.pace_kbit, opts.pace_auto,
+                                     opts.pace_edt, std::move(paced));
+
+    if (resumed) {
+      confirm_take_over(conn());
+    }
+  } catch (...) {
+    if (!listen_path.empty()) {
+      unlink(listen_path.c_str());
+    }
+    throw;
+  }
+
+  if (resumed) {
+    client_addr_ = state.client_addr;
+    gen_id_ = state.gen_id;
+    rx_seq_ = state.rx_seq;
+    tx_cnt_ = state.tx_cnt;
+    session_idx_ = state.session_idx;
+    last_rx_ = std::chrono::steady_clock::now()
+      - std::chrono::minutes(state.idle_minutes);
+    active_ = state.active;
+  }
+
+  if (!listen_path.empty()
+      && rename(listen_path.c_str(), opts.handoff_path.c_str()) < 0) {
+    std::string err = strerror(errno);
+    unlink(listen_path.c_str());
+    handoff_acceptor_.close();
+    if (!resumed) {
+      throw std::runtime_error("handoff listen " + opts.handoff_path + ": "
+                               + err);
+    }
+    // The session is ours already, carry on without hot restart.
+    LOG(WARNING) << "handoff listen " << opts.handoff_path << ": " << err
+      << ", no hot restart from this server";
+  }
+  if (opts.busy_poll_us
+      && !set_busy_poll(socket_.native_handle(), opts.busy_poll_us)) {
+    LOG(WARNING) << "SO_BUSY_POLL unavailable, spinning in user space only";
+  }
+
+  if (resumed) {
+    LOG(INFO) << "took over " << ifname_ << " from the previous server, client("
+      << gen_id_ << ") " << client_addr_;
+  } else if (!handler_) {
+    LOG(INFO) << ifname_ << " is opened, fd=" << fd_.native_handle();
 #if defined(__APPLE__)
-  LOG(INFO) << "hint:$ sudo ifconfig " << ifname_ << " inet 192.168.33.1/24 192.168.33.10 mtu 1448 up";
+    LOG(INFO) << "hint:$ sudo ifconfig " << ifname_ << " inet 192.168.33.1/24 192.168.33.10 mtu 1448 up";
 #elif defined(__linux__)
-  LOG(INFO) << "hint:$ sudo ip a add dev " << ifname_ << " 192.168.33.1/24";
-  LOG(INFO) << "hint:$ sudo ip l set dev " << ifname_ << " mtu 1448 up";
-  LOG(INFO) << "hint:$ sudo iptables -t nat -A POSTROUTING -s 192.168.33.0/24 -o <NIC> -j MASQUERADE";
+    LOG(INFO) << "hint:$ sudo ip a add dev " << ifname_ << " 192.168.33.1/24";
+    LOG(INFO) << "hint:$ sudo ip l set dev " << ifname_ << " mtu 1448 up";
+    LOG(INFO) << "hint:$ sudo iptables -t nat -A POSTROUTING -s 192.168.33.0/24 -o <NIC> -j MASQUERADE";
 #endif
+  }
 }
 
 Server::~Server() {
-  timer_.cancel();
+  if (pool_) {
+    pool_->join();
+  }
+  for (boost::asio::steady_timer& timer : backoff_timers_) {
+    timer.cancel();
+  }
+  handoff_acceptor_.close();
+  handoff_conn_.close();
   socket_.close();
   fd_.close();
 }
 
 void Server::start() {
-  start_reading();
-  start_receiving();
+  start_io();
   start_timing();
+  start_feedback();
+  if (handoff_acceptor_.is_open()) {
+    start_handoff();
+  }
 }
 
-void Server::start_reading() {
-  buf_ptr pbuf = std::make_shared<buf_type>();
-  fd_.async_read_some(boost::asio::buffer(pbuf->data() + crypto_header_len,
-                                          pbuf->size() - crypto_header_len),
-                      std::bind(&Server::read_handler, this, pbuf,
-                                std::placeholders::_1, std::placeholders::_2));
+void Server::submit(const PacketView* pkts, std::size_t n) {
+  for (std::size_t i = 0; i < n; ++i) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    if (pkts[i].len > pbuf->size() - crypto_header_len - tun_frame_len) {
+      continue;
+    }
+    forward_packet(pbuf, frame_packet(pbuf->data() + crypto_header_len,
+                                      pkts[i]));
+  }
 }
 
-void Server::start_receiving() {
-  buf_ptr pbuf = std::make_shared<buf_type>();
-  addr_ptr paddr = std::make_shared<addr_type>();
-  socket_.async_receive_from(boost::asio::buffer(*pbuf), *paddr,
-                             std::bind(&Server::receive_handler, this, pbuf, paddr,
-                                       std::placeholders::_1, std::placeholders::_2));
+boost::asio::ip::udp::endpoint Server::local_endpoint() const {
+  return socket_.local_endpoint();
+}
+
+void Server::start_io() {
+  stopping_ = false;
+  for (unsigned i = 0; i < io_depth_; ++i) {
+    if (!handler_) {
+      boost::asio::co_spawn(io_, read_loop(backoff_timers_[i]),
+                            boost::asio::detached);
+    }
+    boost::asio::co_spawn(io_, receive_loop(), boost::asio::detached);
+  }
+}
+
+void Server::start_handoff() {
+  handoff_acceptor_.async_accept(handoff_conn_,
+                                 std::bind(&Server::handoff_handler, this,
+                                           std::placeholders::_1));
+}
+
+void Server::start_feedback() {
+  wheel_.schedule(feedback_timer_, rate_report_interval,
+                  [this] { feedback_handler(); });
 }
 
 void Server::start_timing() {
-  timer_.expires_at(timer_.expiry() + boost::asio::chrono::seconds(60));
-  timer_.async_wait(std::bind(&Server::timeout_handler, this,
-                              std::placeholders::_1));
+  wheel_.schedule(stats_timer_, stats_interval, [this] { stats_handler(); });
+  if (gen_id_) {
+    idle_handler();
+  }
 }
 
-void Server::read_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                          std::size_t nbytes) {
-  if (ec) {
-    if (ec == boost::system::errc::operation_canceled) {
-      return;
+boost::asio::awaitable<void> Server::read_loop(
+    boost::asio::steady_timer& timer) {
+  ++loops_;
+  std::chrono::milliseconds backoff(0);
+  while (!stopping_) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    boost::system::error_code ec;
+    std::size_t nbytes = co_await fd_.async_read_some(
+      boost::asio::buffer(pbuf->data() + crypto_header_len,
+                          pbuf->size() - crypto_header_len),
+      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec) {
+      if (ec == boost::system::errc::operation_canceled) {
+        break;
+      }
+      BRIDGE_LOG_EC(WARNING, "server read error", ec);
+      // Back off without blocking the io thread, the socket keeps running.
+      // Only cancel() ends the wait early, so it stops the loop.
+      backoff = std::min(std::max(backoff * 2, std::chrono::milliseconds(1)),
+                         std::chrono::milliseconds(1000));
+      timer.expires_after(backoff);
+      co_await timer.async_wait(
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+      if (ec) {
+        break;
+      }
+      continue;
     }
-    LOG(WARNING) << "server read error: " << ec.message() << " (" << ec << ")";
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  }
 
-  start_reading();
+    backoff = std::chrono::milliseconds(0);
+    forward_packet(pbuf, nbytes);
+  }
+  --loops_;
+}
 
-  if (!ec && active_) {
-    std::size_t data_offst = crypto_header_len;
-    std::size_t data_len = nbytes;
-#if defined(__APPLE__)
-    if (pbuf->at(data_offst + 0) != 0 || pbuf->at(data_offst + 1) != 0
-        || pbuf->at(data_offst + 2) != 0 || pbuf->at(data_offst + 3) != 2) {
-      // Family != IP
-      return;
+boost::asio::awaitable<void> Server::receive_loop() {
+  ++loops_;
+  while (!stopping_) {
+    buf_ptr pbuf = std::make_shared<buf_type>();
+    addr_ptr paddr = std::make_shared<addr_type>();
+    boost::system::error_code ec;
+    std::size_t nbytes = co_await socket_.async_receive_from(
+      boost::asio::buffer(*pbuf), *paddr,
+      boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (ec) {
+      if (ec == boost::system::errc::operation_canceled) {
+        break;
+      }
+      BRIDGE_LOG_EC(WARNING, "server receive error", ec);
+      continue;
     }
-    data_offst += 4;
-    data_len -= 4;
-#endif
 
-    Encryptor encryptor(client_id_, pbuf->data(), pbuf->size());
-    if (!encryptor.encrypt(gen_id_, ++tx_cnt_, data_offst, data_len)) {
+    // A read that completed before a handoff cancelled it is still ours.
+    receive_packet(pbuf, paddr, nbytes);
+  }
+  --loops_;
+}
+
+void Server::forward_packet(buf_ptr pbuf, std::size_t nbytes) {
+  if (!active_) {
+    return;
+  }
+
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = crypto_header_len;
+  pkt.len = nbytes;
+  pkt.gen_id = gen_id_;
+  pkt.seq = ++tx_cnt_;
+  pkt.session_idx = session_idx_;
+  BRIDGE_TRACE(tun_read, pkt.seq, nbytes);
+
+  if (tx_queue_) {
+    if (!tx_queue_->submit({pkt, pbuf, {}})) {
       --tx_cnt_;
-      return;
+      BRIDGE_TRACE(queue_drop, pkt.seq, pkt.len);
     }
+    return;
+  }
 
-    ++timed_tx_cnt_;
-
-    socket_.async_send_to(boost::asio::buffer(pbuf->data() + data_offst, data_len),
-                          client_addr_,
-                          [this, pbuf](const boost::system::error_code&,
-                                       std::size_t){});
+  if (!pipeline_.outbound(pkt)) {
+    --tx_cnt_;
+    return;
   }
+
+  send_packet(pbuf, pkt);
 }
 
-void Server::receive_handler(buf_ptr pbuf, addr_ptr paddr,
-                             const boost::system::error_code& ec,
-                             std::size_t nbytes) {
-  if (ec) {
-    if (ec == boost::system::errc::operation_canceled) {
-      return;
+void Server::receive_packet(buf_ptr pbuf, addr_ptr paddr,
+                            std::size_t nbytes) {
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = 0;
+  pkt.len = nbytes;
+  pkt.session_idx = session_idx_;
+  BRIDGE_TRACE(receive, Decryptor(client_id_, pkt.buf, nbytes).peek_seq(),
+               nbytes);
+
+  if (rx_queue_) {
+    if (!rx_queue_->submit({pkt, pbuf, *paddr})) {
+      BRIDGE_TRACE(queue_drop,
+                   Decryptor(client_id_, pkt.buf, pkt.len).peek_seq(), pkt.len);
     }
-    LOG(WARNING) << "server receive error: " << ec.message() << " (" << ec << ")";
+    return;
   }
 
-  start_receiving();
+  if (!pipeline_.inbound(pkt)) {
+    return;
+  }
 
-  if (!ec) {
-    std::size_t data_offst = 0;
-    std::size_t data_len = nbytes;
-    uint64_t gen_id = 0;
-    uint64_t pkt_seq = 0;
+  write_packet(pbuf, *paddr, pkt);
+}
 
-    Decryptor decryptor(client_id_, pbuf->data() + data_offst, data_len);
-    if (!decryptor.decrypt(gen_id, pkt_seq, data_offst, data_len)) {
-      return;
-    }
+void Server::send_packet(buf_ptr pbuf, const Packet& pkt) {
+  BRIDGE_TRACE(send, pkt.seq, pkt.len);
+  ++timed_tx_cnt_;
+  Datagram dgram{pbuf, pkt.data(), pkt.len, client_addr_};
+  pacer_->submit(dgram);
+}
 
-    if (gen_id < gen_id_) {
-      return;
-    } else if (gen_id == gen_id_) {
-      if (pkt_seq <= rx_seq_) {
-        if (*paddr != client_addr_) {
-          return;
-        }
-      } else {
-        if (client_addr_ != *paddr) {
-          LOG(INFO) << "client(" << gen_id_ << ") changed from "
-            << client_addr_ << " to " << *paddr;
-          client_addr_ = *paddr;
-        }
-        rx_seq_ = pkt_seq;
+void Server::transmit(const Datagram& dgram) {
+  if (dgram.txtime && send_at(socket_.native_handle(), dgram.data, dgram.len,
+                              dgram.addr.data(), dgram.addr.size(),
+                              dgram.txtime)) {
+    return;
+  }
+  socket_.async_send_to(boost::asio::buffer(dgram.data, dgram.len),
+                        dgram.addr,
+                        [owner = dgram.owner](const boost::system::error_code&,
+                                              std::size_t){});
+}
+
+void Server::write_packet(buf_ptr pbuf, const addr_type& addr,
+                          const Packet& pkt) {
+  uint64_t gen_id = pkt.compact ? gen_id_ : pkt.gen_id;
+  uint64_t pkt_seq = pkt.compact ? expand_seq(pkt.seq, rx_seq_) : pkt.seq;
+
+  if (gen_id < gen_id_) {
+    BRIDGE_TRACE(replay_drop, pkt_seq, pkt.len);
+    return;
+  } else if (gen_id == gen_id_) {
+    if (pkt_seq <= rx_seq_) {
+      if (addr != client_addr_) {
+        BRIDGE_TRACE(replay_drop, pkt_seq, pkt.len);
+        return;
       }
     } else {
-      LOG(INFO) << "new client(" << gen_id << ") " << *paddr;
-      client_addr_ = *paddr;
-      gen_id_ = gen_id;
+      if (client_addr_ != addr) {
+        BRIDGE_LOG_ADDR(INFO, "roaming client", gen_id_, addr);
+        client_addr_ = addr;
+      }
       rx_seq_ = pkt_seq;
     }
+  } else {
+    BRIDGE_LOG_ADDR(INFO, "new client", gen_id, addr);
+    client_addr_ = addr;
+    gen_id_ = gen_id;
+    rx_seq_ = pkt_seq;
+    session_idx_ = 0;
+  }
 
-    ++rx_cnt_;
-    ++timed_rx_cnt_;
-    zero_rx_times_ = 0;
-    active_ = true;
+  ++rx_cnt_;
+  pipeline_.stage<Stats>().received(pkt);
+  ++timed_rx_cnt_;
+  last_rx_ = std::chrono::steady_clock::now();
+  active_ = true;
+  if (!idle_timer_.pending()) {
+    wheel_.schedule(idle_timer_, idle_timeout, [this] { idle_handler(); });
+  }
 
-#if defined(__APPLE__)
-    data_offst -= 4;
-    data_len += 4;
-    pbuf->at(data_offst + 0) = 0;
-    pbuf->at(data_offst + 1) = 0;
-    pbuf->at(data_offst + 2) = 0;
-    pbuf->at(data_offst + 3) = 2;
-#endif
+  if (pkt.control) {
+    control_handler(pkt.data(), pkt.len);
+    return;
+  }
+
+  BRIDGE_TRACE(tun_write, pkt_seq, pkt.len);
+  if (handler_) {
+    PacketView view = unframe_packet(pkt.data(), pkt.len);
+    handler_(view.data, view.len);
+    return;
+  }
 
-    boost::asio::async_write(fd_,
-                             boost::asio::buffer(pbuf->data() + data_offst, data_len),
-                             [this, pbuf](const boost::system::error_code&,
-                                          std::size_t){});
+  boost::asio::async_write(fd_,
+                           boost::asio::buffer(pkt.data(), pkt.len),
+                           [this, pbuf](const boost::system::error_code&,
+                                        std::size_t){});
+}
+
+void Server::stats_handler() {
+  wheel_.schedule(stats_timer_, stats_interval, [this] { stats_handler(); });
+
+  if (active_) {
+    LOG(INFO) << "rx=" << timed_rx_cnt_ << ", tx=" << timed_tx_cnt_;
+  }
+  timed_rx_cnt_ = 0;
+  timed_tx_cnt_ = 0;
+}
+
+void Server::idle_handler() {
+  // Packets only stamp last_rx_, the timer catches up here.
+  auto idle = std::chrono::steady_clock::now() - last_rx_;
+  if (idle < idle_timeout) {
+    wheel_.schedule(idle_timer_, idle_timeout - idle,
+                    [this] { idle_handler(); });
+    return;
+  }
+
+  if (gen_id_) {
+    LOG(INFO) << "client(" << gen_id_ << ") " << client_addr_ << " timed out";
   }
+  gen_id_ = 0;
+  rx_seq_ = 0;
+  session_idx_ = 0;
+  active_ = false;
 }
 
-void Server::timeout_handler(const boost::system::error_code& ec) {
+void Server::handoff_handler(const boost::system::error_code& ec) {
   if (ec) {
     if (ec == boost::system::errc::operation_canceled) {
       return;
     }
-    LOG(WARNING) << "server timer error: " << ec.message() << " (" << ec << ")";
+    LOG(WARNING) << "handoff accept error: " << ec.message() << " (" << ec << ")";
+    start_handoff();
+    return;
   }
 
-  start_timing();
+  // The socket is private to our user, but root can connect regardless,
+  // and a successor gets root's fds.
+  if (!peer_trusted(handoff_conn_.native_handle())) {
+    LOG(WARNING) << "refused handoff to a process of another user";
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    start_handoff();
+    return;
+  }
 
-  if (!ec) {
-    if (active_) {
-      LOG(INFO) << "rx=" << timed_rx_cnt_ << ", tx=" << timed_tx_cnt_;
-    }
-    if (!timed_rx_cnt_) {
-      if (++zero_rx_times_ >= 5) {
-        if (gen_id_) {
-          LOG(INFO) << "client(" << gen_id_ << ") "
-            << client_addr_ << " timed out";
-        }
-        gen_id_ = 0;
-        rx_seq_ = 0;
-        active_ = false;
-      }
+  // Hear the successor out before giving anything away, but not forever.
+  wheel_.schedule(handoff_timer_, handoff_timeout, [this] {
+    LOG(WARNING) << "handoff request timed out";
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    start_handoff();
+  });
+  boost::asio::async_read(handoff_conn_, boost::asio::buffer(handoff_request_),
+                          std::bind(&Server::request_handler, this,
+                                    std::placeholders::_1));
+}
+
+void Server::request_handler(const boost::system::error_code& ec) {
+  if (ec == boost::system::errc::operation_canceled) {
+    return;
+  }
+  handoff_timer_.cancel();
+  uint32_t client_id = 0;
+  if (ec || !unpack_request(handoff_request_.data(), client_id)
+      || client_id != client_id_) {
+    // Closing tells the successor it was refused.
+    if (ec) {
+      LOG(WARNING) << "handoff request error: " << ec.message() << " (" << ec << ")";
+    } else {
+      LOG(WARNING) << "refused handoff to a server of client_id " << client_id;
     }
-    timed_rx_cnt_ = 0;
-    timed_tx_cnt_ = 0;
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    start_handoff();
+    return;
   }
+
+  // Stop reading before the successor can, so the state we send is the
+  // last word. Whatever arrives meanwhile waits in the kernel for it.
+  stopping_ = true;
+  fd_.cancel();
+  socket_.cancel();
+  for (boost::asio::steady_timer& timer : backoff_timers_) {
+    timer.cancel();
+  }
+  feedback_timer_.cancel();
+  settle_handler(std::chrono::steady_clock::now() + settle_timeout);
+}
+
+void Server::settle_handler(std::chrono::steady_clock::time_point deadline) {
+  // Reads that completed before the cancel and packets still being
+  // decrypted move rx_seq_, gen_id_ and the session along; let them land
+  // before taking the snapshot.
+  if (loops_ || (rx_queue_ && rx_queue_->size())) {
+    if (std::chrono::steady_clock::now() < deadline) {
+      wheel_.schedule(handoff_timer_, std::chrono::milliseconds(1),
+                      [this, deadline] { settle_handler(deadline); });
+      return;
+    }
+    LOG(WARNING) << "inbound did not settle for the handoff, carrying on";
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    resume();
+    return;
+  }
+
+  HandoffState state;
+  state.client_id = client_id_;
+  state.ifname = ifname_;
+  state.client_addr = client_addr_;
+  state.gen_id = gen_id_;
+  state.rx_seq = rx_seq_;
+  state.tx_cnt = tx_cnt_;
+  state.session_idx = session_idx_;
+  state.idle_minutes = std::chrono::duration_cast<std::chrono::minutes>(
+    std::chrono::steady_clock::now() - last_rx_).count();
+  state.active = active_;
+  if (!hand_off(handoff_conn_.native_handle(), fd_.native_handle(),
+                socket_.native_handle(), state)) {
+    LOG(WARNING) << "handoff failed, carrying on";
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    resume();
+    return;
+  }
+
+  // The successor may still fail to set up, keep everything until it
+  // says it is ready.
+  wheel_.schedule(handoff_timer_, handoff_timeout, [this] {
+    LOG(WARNING) << "new server did not confirm the handoff, carrying on";
+    boost::system::error_code ignored;
+    handoff_conn_.close(ignored);
+    resume();
+  });
+  boost::asio::async_read(handoff_conn_,
+                          boost::asio::buffer(&handoff_reply_, 1),
+                          std::bind(&Server::confirm_handler, this,
+                                    std::placeholders::_1));
+}
+
+void Server::confirm_handler(const boost::system::error_code& ec) {
+  if (ec == boost::system::errc::operation_canceled
+      || !handoff_conn_.is_open()) {
+    // Timed out already.
+    return;
+  }
+  handoff_timer_.cancel();
+  boost::system::error_code wec;
+  if (!ec && handoff_reply_ == handoff_ready) {
+    boost::asio::write(handoff_conn_, boost::asio::buffer(&handoff_go, 1),
+                       wec);
+  }
+  boost::system::error_code ignored;
+  handoff_conn_.close(ignored);
+  if (ec || handoff_reply_ != handoff_ready || wec) {
+    LOG(WARNING) << "new server failed to start, carrying on";
+    resume();
+    return;
+  }
+
+  LOG(INFO) << "handed " << ifname_ << " over to the new server, draining";
+  handoff_acceptor_.close();
+  stats_timer_.cancel();
+  idle_timer_.cancel();
+  drain_handler(std::chrono::steady_clock::now() + drain_timeout);
+}
+
+void Server::resume() {
+  start_io();
+  start_feedback();
+  start_handoff();
+}
+
+void Server::drain_handler(std::chrono::steady_clock::time_point deadline) {
+  // Packets still in the crypto workers, the pacer or the impairment go
+  // out on our copies of the fds, the successor shares the same ones.
+  std::size_t left = pacer_->pending();
+  if (impair_) {
+    left += impair_->pending();
+  }
+  if (tx_queue_) {
+    left += tx_queue_->size();
+  }
+  if (left && std::chrono::steady_clock::now() < deadline) {
+    wheel_.schedule(drain_timer_, std::chrono::milliseconds(10),
+                    [this, deadline] { drain_handler(deadline); });
+    return;
+  }
+
+  if (left) {
+    LOG(WARNING) << "dropped " << left << " packets still queued at handoff";
+  }
+  LOG(INFO) << "handoff done, exiting";
+  io_.stop();
+}
+
+void Server::feedback_handler() {
+  const Stats& stats = pipeline_.stage<Stats>();
+  if (active_ && stats.rx_pkts != reported_rx_pkts_) {
+    reported_rx_pkts_ = stats.rx_pkts;
+    send_control(control_rate, 0, stats.rx_bytes, stats.rx_pkts);
+  }
+  start_feedback();
+}
+
+void Server::control_handler(const uint8_t* data, std::size_t len) {
+  Control ctrl;
+  if (!unpack_control(data, len, ctrl)) {
+    return;
+  }
+
+  switch (ctrl.type) {
+    case control_hello:
+      if (!session_idx_) {
+        std::random_device rd;
+        std::uniform_int_distribution<uint32_t> distribution(1);
+        session_idx_ = distribution(rd);
+        LOG(INFO) << "client(" << gen_id_ << ") session " << session_idx_;
+      }
+      send_control(control_welcome, session_idx_);
+      break;
+    case control_probe:
+      send_control(control_probe_reply, ctrl.arg, ctrl.val0);
+      break;
+    case control_rate:
+      pacer_->feedback(ctrl.val0, ctrl.val1);
+      break;
+    default:
+      break;
+  }
+}
+
+void Server::send_control(uint8_t type, uint32_t arg, uint64_t val0,
+                          uint64_t val1) {
+  buf_ptr pbuf = std::make_shared<buf_type>();
+  Packet pkt;
+  pkt.buf = pbuf->data();
+  pkt.size = pbuf->size();
+  pkt.offst = crypto_header_len;
+  pkt.len = control_len;
+  pkt.gen_id = gen_id_;
+  pkt.seq = ++tx_cnt_;
+
+  Control ctrl;
+  ctrl.type = type;
+  ctrl.arg = arg;
+  ctrl.val0 = val0;
+  ctrl.val1 = val1;
+  pack_control(pkt.data(), ctrl);
+
+  // Skip the platform header, control messages never had one, and leave
+  // session_idx 0 as the peer may not know its index yet.
+  if (!pipeline_.stage<CryptoPipeline>().stage<Cipher>().outbound(pkt)
+      || !pipeline_.stage<Stats>().outbound(pkt)) {
+    --tx_cnt_;
+    return;
+  }
+
+  send_packet(pbuf, pkt);
 }
@@ -9,53 +9,128 @@
 #define server_hpp
 
 #include <array>
+#include <chrono>
 #include <memory>
 #include <string>
-#include <boost/asio.hpp>
+#include <vector>
+#include "asio_compat.hpp"
+#include "handoff.hpp"
+#include "impair.hpp"
+#include "options.hpp"
+#include "pacer.hpp"
+#include "ordered_queue.hpp"
+#include "packet_io.hpp"
+#include "pipeline.hpp"
+#include "timer_wheel.hpp"
 
 namespace bridge {
 
 class Server {
  public:
   explicit Server(boost::asio::io_context& io, const std::string& ip,
-                  const std::string& port, uint32_t client_id);
+                  const std::string& port, uint32_t client_id,
+                  const Options& opts, PacketHandler handler = nullptr);
   virtual ~Server();
 
   void start();
 
+  // With a handler no TUN device is opened: inner packets are injected
+  // here and handed to the handler instead of being written to TUN.
+  // Must be called on the io_context thread.
+  void submit(const PacketView* pkts, std::size_t n);
+
+  // Where the server receives, e.g. to learn the port after binding "0".
+  boost::asio::ip::udp::endpoint local_endpoint() const;
+
  private:
   using buf_type = std::array<uint8_t, 4096>;
   using buf_ptr = std::shared_ptr<buf_type>;
   using addr_type = boost::asio::ip::udp::endpoint;
   using addr_ptr = std::shared_ptr<addr_type>;
 
-  void start_reading();
-  void start_receiving();
+  // Each loop keeps one read in flight; start() runs io_depth of each.
+  // A read loop backs off on its own timer, so that one failing reader
+  // never cuts short another's wait.
+  boost::asio::awaitable<void> read_loop(boost::asio::steady_timer& timer);
+  boost::asio::awaitable<void> receive_loop();
+  void start_io();
   void start_timing();
-  void read_handler(buf_ptr pbuf, const boost::system::error_code& ec,
-                    std::size_t nbytes);
-  void receive_handler(buf_ptr pbuf, addr_ptr paddr,
-                       const boost::system::error_code& ec, std::size_t nbytes);
-  void timeout_handler(const boost::system::error_code& ec);
+  void start_handoff();
+  void start_feedback();
+  void receive_packet(buf_ptr pbuf, addr_ptr paddr, std::size_t nbytes);
+  void forward_packet(buf_ptr pbuf, std::size_t nbytes);
+  void send_packet(buf_ptr pbuf, const Packet& pkt);
+  void transmit(const Datagram& dgram);
+  void write_packet(buf_ptr pbuf, const addr_type& addr, const Packet& pkt);
+  void stats_handler();
+  void idle_handler();
+  void feedback_handler();
+  void handoff_handler(const boost::system::error_code& ec);
+  void request_handler(const boost::system::error_code& ec);
+  void settle_handler(std::chrono::steady_clock::time_point deadline);
+  void confirm_handler(const boost::system::error_code& ec);
+  void resume();
+  void drain_handler(std::chrono::steady_clock::time_point deadline);
+  void control_handler(const uint8_t* data, std::size_t len);
+  void send_control(uint8_t type, uint32_t arg, uint64_t val0 = 0,
+                    uint64_t val1 = 0);
 
   boost::asio::io_context& io_;
   std::string ifname_;
   boost::asio::posix::stream_descriptor fd_;
   boost::asio::ip::udp::socket socket_;
-  boost::asio::steady_timer timer_;
+  // Delay the next TUN read after an error, one per read loop. Not on
+  // the wheel, the read loops co_await them.
+  std::vector<boost::asio::steady_timer> backoff_timers_;
+  // Session timers, rate reports, the pacer and impairment all run on
+  // this wheel.
+  TimerWheel wheel_;
+  TimerWheel::Timer stats_timer_;
+  TimerWheel::Timer feedback_timer_;
+  // Armed while a session exists, re-armed lazily from last_rx_.
+  TimerWheel::Timer idle_timer_;
+  unsigned io_depth_;
+  // Read and receive loops still running, and whether they are to stop
+  // for a handoff.
+  unsigned loops_ = 0;
+  bool stopping_ = false;
+  // Listens for a successor when hot restart is on, one at a time.
+  boost::asio::local::stream_protocol::acceptor handoff_acceptor_;
+  boost::asio::local::stream_protocol::socket handoff_conn_;
+  std::array<uint8_t, handoff_request_len> handoff_request_;
+  uint8_t handoff_reply_ = 0;
+  TimerWheel::Timer handoff_timer_;
+  // Polls the queues empty after a handoff.
+  TimerWheel::Timer drain_timer_;
   uint32_t client_id_;
+  PacketHandler handler_;
+  TunnelPipeline pipeline_;
 
   addr_type client_addr_;
   uint64_t gen_id_ = 0;
   uint64_t rx_seq_ = 0;
+  // Non-zero once the client asked for compact headers.
+  uint32_t session_idx_ = 0;
 
   uint64_t rx_cnt_ = 0;
   uint64_t tx_cnt_ = 0;
   uint64_t timed_rx_cnt_ = 0;
   uint64_t timed_tx_cnt_ = 0;
-  uint64_t zero_rx_times_ = 0;
+  std::chrono::steady_clock::time_point last_rx_;
   bool active_ = false;
 
+  // Shapes and accounts for what we send, unshaped unless configured.
+  std::unique_ptr<Pacer> pacer_;
+  uint64_t reported_rx_pkts_ = 0;
+  // Only for testing, shapes what we send.
+  std::unique_ptr<Impairment> impair_;
+
+  // Only with crypto workers, the pool is declared last so that its
+  // threads are joined before the queues go away.
+  std::unique_ptr<OrderedQueue> tx_queue_;
+  std::unique_ptr<OrderedQueue> rx_queue_;
+  std::unique_ptr<boost::asio::thread_pool> pool_;
+
   Server(const Server&) = delete;
   Server& operator=(const Server&) = delete;
 };
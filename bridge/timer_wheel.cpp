@@ -0,0 +1,231 @@
+//
+//  timer_wheel.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <algorithm>
+#include "timer_wheel.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// First set bit at or after from in a 256 bit map, 256 if none.
+unsigned find_bit(const uint64_t* bits, unsigned from) {
+  for (unsigned w = from / 64; w < 4; ++w) {
+    uint64_t word = bits[w];
+    if (w == from / 64) {
+      word &= ~uint64_t(0) << (from % 64);
+    }
+    if (word) {
+      return w * 64 + __builtin_ctzll(word);
+    }
+  }
+  return 256;
+}
+
+}
+
+void TimerWheel::Timer::cancel() {
+  if (pending()) {
+    wheel_->unlink(*this);
+  }
+}
+
+TimerWheel::TimerWheel(boost::asio::io_context& io, clock::duration tick)
+    : timer_(io),
+      origin_(clock::now()),
+      tick_(tick) {
+  for (Link& head : heads_) {
+    head.prev = &head;
+    head.next = &head;
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  for (Link& head : heads_) {
+    while (head.next != &head) {
+      unlink(*static_cast<Timer*>(head.next));
+    }
+  }
+  timer_.cancel();
+}
+
+void TimerWheel::schedule(Timer& t, clock::duration after,
+                          std::function<void()> fn) {
+  t.cancel();
+  uint64_t now = now_tick();
+  if (!count_) {
+    // Nothing pending, skip the idle ticks instead of walking them.
+    current_ = std::max(current_, now);
+  }
+
+  uint64_t ticks = (std::max(after, clock::duration::zero()) + tick_
+                    - clock::duration(1)) / tick_;
+  t.wheel_ = this;
+  t.expiry_ = std::max(now + ticks, current_);
+  t.fn_ = std::move(fn);
+  link(t);
+
+  arm();
+}
+
+TimerWheel::clock::time_point TimerWheel::now() const {
+  return clock::now();
+}
+
+uint64_t TimerWheel::now_tick() const {
+  return (now() - origin_) / tick_;
+}
+
+void TimerWheel::place(Timer& t) {
+  // Beyond the top level, park in its last slot and cascade again later.
+  uint64_t delta = std::min<uint64_t>(t.expiry_ - current_,
+                                      (uint64_t(1) << (levels * level_bits)) - 1);
+  int level = 0;
+  while (delta >> ((level + 1) * level_bits)) {
+    ++level;
+  }
+  uint64_t at = current_ + delta;
+  t.slot_ = (uint16_t) (level * level_slots
+                        + ((at >> (level * level_bits)) & (level_slots - 1)));
+
+  Link& head = heads_[t.slot_];
+  t.prev = head.prev;
+  t.next = &head;
+  head.prev->next = &t;
+  head.prev = &t;
+  occupied_[t.slot_ / 64] |= uint64_t(1) << (t.slot_ % 64);
+}
+
+void TimerWheel::link(Timer& t) {
+  place(t);
+  ++count_;
+}
+
+void TimerWheel::unlink(Timer& t) {
+  detach(t);
+  Link& head = heads_[t.slot_];
+  if (head.next == &head) {
+    occupied_[t.slot_ / 64] &= ~(uint64_t(1) << (t.slot_ % 64));
+  }
+  --count_;
+}
+
+void TimerWheel::detach(Link& l) {
+  l.prev->next = l.next;
+  l.next->prev = l.prev;
+  l.prev = nullptr;
+  l.next = nullptr;
+}
+
+void TimerWheel::cascade(int level) {
+  std::size_t slot = level * level_slots
+    + ((current_ >> (level * level_bits)) & (level_slots - 1));
+  Link& head = heads_[slot];
+  occupied_[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+  while (head.next != &head) {
+    Timer& t = *static_cast<Timer*>(head.next);
+    detach(t);
+    place(t);
+  }
+}
+
+uint64_t TimerWheel::next_tick() const {
+  uint64_t best = UINT64_MAX;
+  for (int level = 0; level < levels; ++level) {
+    unsigned shift = level * level_bits;
+    // The first slot of this level not handled yet; on the upper levels
+    // the slot current_ is in was cascaded when current_ entered it.
+    uint64_t pos = level ? (current_ + (uint64_t(1) << shift) - 1) >> shift
+                         : current_;
+    unsigned from = (unsigned) (pos & (level_slots - 1));
+    const uint64_t* bits = &occupied_[level * level_slots / 64];
+    unsigned idx = find_bit(bits, from);
+    uint64_t at;
+    if (idx < level_slots) {
+      at = pos + (idx - from);
+    } else if ((idx = find_bit(bits, 0)) < from) {
+      at = pos + (level_slots - from) + idx;
+    } else {
+      continue;
+    }
+    best = std::min(best, at << shift);
+  }
+  return best;
+}
+
+void TimerWheel::arm() {
+  if (!count_) {
+    return;
+  }
+  uint64_t tick = next_tick();
+  if (armed_ && tick >= armed_tick_) {
+    return;
+  }
+  // Moving the expiry aborts a later wait.
+  armed_ = true;
+  armed_tick_ = tick;
+  timer_.expires_at(origin_ + tick * tick_);
+  timer_.async_wait(std::bind(&TimerWheel::tick_handler, this,
+                              std::placeholders::_1));
+}
+
+void TimerWheel::tick_handler(const boost::system::error_code& ec) {
+  if (ec) {
+    // Re-armed or destroyed, leave this alone.
+    return;
+  }
+  armed_ = false;
+  expire();
+  arm();
+}
+
+void TimerWheel::expire() {
+  uint64_t now = now_tick();
+  while (count_) {
+    uint64_t tick = next_tick();
+    if (tick > now) {
+      // Nothing in between, jump over the idle ticks.
+      current_ = now + 1;
+      break;
+    }
+    current_ = tick;
+    for (int level = levels - 1; level > 0; --level) {
+      if (!(current_ & ((uint64_t(1) << (level * level_bits)) - 1))) {
+        cascade(level);
+      }
+    }
+
+    // Everything in the bottom slot is due. Move it out first, callbacks
+    // may schedule into this slot; they land on the next tick instead.
+    std::size_t slot = current_ & (level_slots - 1);
+    Link& head = heads_[slot];
+    Link due;
+    due.prev = &due;
+    due.next = &due;
+    if (head.next != &head) {
+      due.next = head.next;
+      due.prev = head.prev;
+      due.next->prev = &due;
+      due.prev->next = &due;
+      head.next = &head;
+      head.prev = &head;
+    }
+    occupied_[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+    ++current_;
+
+    while (due.next != &due) {
+      // Still pending until here, a callback may cancel it from the due list.
+      Timer& t = *static_cast<Timer*>(due.next);
+      unlink(t);
+      std::function<void()> fn = std::move(t.fn_);
+      fn();
+    }
+  }
+  if (!count_) {
+    current_ = std::max(current_, now + 1);
+  }
+}
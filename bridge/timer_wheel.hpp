@@ -0,0 +1,111 @@
+//
+//  timer_wheel.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef timer_wheel_hpp
+#define timer_wheel_hpp
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include "asio_compat.hpp"
+
+namespace bridge {
+
+// Hierarchical timing wheel driven by a single steady_timer.
+// Four levels of 256 slots cover 2^32 ticks; a timer sits in the coarsest
+// level its delay needs and cascades down as its expiry comes closer.
+// Timers are intrusive list nodes owned by the caller, so schedule() and
+// cancel() are O(1). The wheel itself does not allocate; fn does only if
+// it is too big for std::function's inline storage (more than two
+// pointers on libstdc++). The steady_timer is only armed for the next tick
+// with work to do, not every tick.
+class TimerWheel {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  class Timer;
+
+  struct Link {
+    Link* prev = nullptr;
+    Link* next = nullptr;
+  };
+
+  class Timer : private Link {
+   public:
+    Timer() = default;
+    ~Timer() { cancel(); }
+
+    bool pending() const { return prev != nullptr; }
+    void cancel();
+
+   private:
+    friend class TimerWheel;
+
+    TimerWheel* wheel_ = nullptr;
+    uint64_t expiry_ = 0;
+    // Index into heads_ while pending.
+    uint16_t slot_ = 0;
+    std::function<void()> fn_;
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+  };
+
+  explicit TimerWheel(boost::asio::io_context& io,
+                      clock::duration tick = std::chrono::milliseconds(1));
+  virtual ~TimerWheel();
+
+  // (Re)arm t to run fn on the io thread after the given delay,
+  // rounded up to whole ticks.
+  void schedule(Timer& t, clock::duration after, std::function<void()> fn);
+
+  // Number of pending timers.
+  std::size_t size() const { return count_; }
+
+ protected:
+  // The wheel's time source, tests put a fake clock here.
+  virtual clock::time_point now() const;
+  // Run everything due by now(), the steady_timer calls this.
+  void expire();
+
+ private:
+  static constexpr int levels = 4;
+  static constexpr int level_bits = 8;
+  static constexpr std::size_t level_slots = 1 << level_bits;
+
+  uint64_t now_tick() const;
+  // Put t in the slot for its expiry, relative to current_.
+  void place(Timer& t);
+  void link(Timer& t);
+  void unlink(Timer& t);
+  void detach(Link& l);
+  void cascade(int level);
+  // The first tick >= current_ with timers to fire or to cascade.
+  uint64_t next_tick() const;
+  void arm();
+  void tick_handler(const boost::system::error_code& ec);
+
+  boost::asio::steady_timer timer_;
+  clock::time_point origin_;
+  clock::duration tick_;
+  // Next tick to process.
+  uint64_t current_ = 0;
+  std::size_t count_ = 0;
+  bool armed_ = false;
+  uint64_t armed_tick_ = 0;
+  std::array<Link, levels * level_slots> heads_;
+  // One bit per non-empty slot.
+  std::array<uint64_t, levels * level_slots / 64> occupied_{};
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+};
+
+}
+
+#endif /* timer_wheel_hpp */
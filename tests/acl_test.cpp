@@ -0,0 +1,232 @@
+//
+//  acl_test.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "acl.hpp"
+#include "check.hpp"
+
+using namespace bridge;
+
+namespace {
+
+const bool in = true;
+const bool out = false;
+
+// Rules in a temporary file, loaded for client_id 7.
+std::shared_ptr<const Acl> load(const std::string& rules) {
+  char path[] = "/tmp/acl_test.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  CHECK(write(fd, rules.data(), rules.size()) == (ssize_t) rules.size());
+  close(fd);
+  std::shared_ptr<const Acl> acl;
+  try {
+    acl = Acl::load(path, 7);
+  } catch (...) {
+    unlink(path);
+    throw;
+  }
+  unlink(path);
+  return acl;
+}
+
+bool rejected(const std::string& rules) {
+  try {
+    load(rules);
+  } catch (const std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+uint32_t ip(int a, int b, int c, int d) {
+  return ((uint32_t) a << 24) | ((uint32_t) b << 16) | ((uint32_t) c << 8) | d;
+}
+
+// An IPv4 header with the first four bytes of a TCP or UDP header.
+// frag is the fragment offset in 8 byte units.
+std::vector<uint8_t> ipv4(uint8_t proto, uint32_t src, uint32_t dst,
+                          uint16_t sport = 0, uint16_t dport = 0,
+                          uint16_t frag = 0) {
+  std::vector<uint8_t> pkt(28, 0);
+  pkt[0] = 0x45;
+  pkt[6] = (uint8_t) (frag >> 8);
+  pkt[7] = (uint8_t) frag;
+  pkt[9] = proto;
+  for (int i = 0; i < 4; ++i) {
+    pkt[12 + i] = (uint8_t) (src >> (24 - 8 * i));
+    pkt[16 + i] = (uint8_t) (dst >> (24 - 8 * i));
+  }
+  pkt[20] = (uint8_t) (sport >> 8);
+  pkt[21] = (uint8_t) sport;
+  pkt[22] = (uint8_t) (dport >> 8);
+  pkt[23] = (uint8_t) dport;
+  return pkt;
+}
+
+std::vector<uint8_t> ipv6(uint8_t next_header) {
+  std::vector<uint8_t> pkt(48, 0);
+  pkt[0] = 0x60;
+  pkt[6] = next_header;
+  return pkt;
+}
+
+bool allow(const Acl& acl, bool inbound, const std::vector<uint8_t>& pkt) {
+  return acl.allow(inbound, pkt.data(), pkt.size());
+}
+
+// Every malformed line is refused with the load, none is skipped.
+void test_syntax() {
+  CHECK(!rejected(""));
+  CHECK(!rejected("# only a comment\n\n   \n"));
+  CHECK(!rejected("allow in proto tcp src 10.0.0.0/8 dst 1.2.3.4 "
+                  "sport 1-2 dport 80 client 7 # trailing comment\n"));
+  CHECK(rejected("permit in\n"));
+  CHECK(rejected("allow sideways\n"));
+  CHECK(rejected("allow proto\n"));
+  CHECK(rejected("allow proto gre\n"));
+  CHECK(rejected("allow proto 256\n"));
+  CHECK(rejected("allow src 10.0.0.0/33\n"));
+  CHECK(rejected("allow src 10.0.0.0/-1\n"));
+  CHECK(rejected("allow src 10.0.0\n"));
+  CHECK(rejected("allow dst ::1\n"));
+  CHECK(rejected("allow dport 70000\n"));
+  CHECK(rejected("allow dport 2000-1000\n"));
+  CHECK(rejected("allow sport 1-\n"));
+  CHECK(rejected("allow sport +80\n"));
+  CHECK(rejected("allow client 0\n"));
+  CHECK(rejected("allow client 4294967296\n"));
+  CHECK(rejected("default\n"));
+  CHECK(rejected("default maybe\n"));
+  CHECK(rejected("default deny in\n"));
+  // The error names the line.
+  try {
+    load("allow\n\ndeny bogus 1\n");
+    CHECK(false);
+  } catch (const std::runtime_error& e) {
+    CHECK(std::string(e.what()).find("line 3") != std::string::npos);
+  }
+  bool missing = false;
+  try {
+    Acl::load("/nonexistent/acl", 7);
+  } catch (const std::runtime_error&) {
+    missing = true;
+  }
+  CHECK(missing);
+}
+
+// 64 rules of this client fit, a 65th is refused. Other clients' rules do
+// not count.
+void test_rule_limit() {
+  std::string rules;
+  for (std::size_t i = 0; i < Acl::max_rules; ++i) {
+    rules += "deny proto " + std::to_string(i) + "\n";
+  }
+  rules += "allow client 8\n";
+  std::shared_ptr<const Acl> acl = load(rules);
+  // The last one is still in effect.
+  CHECK(!allow(*acl, in, ipv4((uint8_t) (Acl::max_rules - 1), 1, 2)));
+  CHECK(allow(*acl, in, ipv4((uint8_t) Acl::max_rules, 1, 2)));
+  CHECK(rejected(rules + "allow\n"));
+  CHECK(rejected(rules + "allow client 7\n"));
+}
+
+// Prefixes and port ranges match at their edges and not one past them,
+// the first matching rule wins and the direction counts.
+void test_matching() {
+  std::shared_ptr<const Acl> acl = load(
+    "allow out proto tcp src 10.1.2.3 dport 1000-2000\n"
+    "deny proto tcp dst 10.1.0.0/16 dport 1000-2000\n"
+    "deny in proto udp sport 53\n"
+    "default allow\n");
+  uint32_t src = ip(192, 168, 0, 1);
+  CHECK(allow(*acl, in, ipv4(6, src, ip(10, 1, 0, 0), 5, 999)));
+  CHECK(!allow(*acl, in, ipv4(6, src, ip(10, 1, 0, 0), 5, 1000)));
+  CHECK(!allow(*acl, in, ipv4(6, src, ip(10, 1, 255, 255), 5, 2000)));
+  CHECK(allow(*acl, in, ipv4(6, src, ip(10, 1, 255, 255), 5, 2001)));
+  CHECK(allow(*acl, in, ipv4(6, src, ip(10, 0, 255, 255), 5, 1500)));
+  CHECK(allow(*acl, in, ipv4(6, src, ip(10, 2, 0, 0), 5, 1500)));
+  // Same ports over UDP match no rule.
+  CHECK(allow(*acl, in, ipv4(17, src, ip(10, 1, 0, 0), 5, 1500)));
+
+  // The allow rule comes first, but only outbound.
+  CHECK(allow(*acl, out, ipv4(6, ip(10, 1, 2, 3), ip(10, 1, 0, 0), 5, 1500)));
+  CHECK(!allow(*acl, in, ipv4(6, ip(10, 1, 2, 3), ip(10, 1, 0, 0), 5, 1500)));
+
+  CHECK(!allow(*acl, in, ipv4(17, src, src, 53, 5)));
+  CHECK(allow(*acl, out, ipv4(17, src, src, 53, 5)));
+
+  // A deny default applies to what matches nothing, a /0 matches all.
+  acl = load("allow src 0.0.0.0/0 dport 22\ndefault deny\n");
+  CHECK(allow(*acl, in, ipv4(6, ip(255, 255, 255, 255), 1, 5, 22)));
+  CHECK(!allow(*acl, in, ipv4(6, ip(255, 255, 255, 255), 1, 5, 23)));
+  // Port rules do not match protocols without ports.
+  CHECK(!allow(*acl, in, ipv4(1, 1, 2)));
+}
+
+// Later fragments carry no ports and match port rules as if they did.
+void test_fragments() {
+  std::shared_ptr<const Acl> acl = load(
+    "deny proto udp dst 10.0.0.1 dport 53\n"
+    "default allow\n");
+  uint32_t src = ip(10, 0, 0, 2);
+  uint32_t dns = ip(10, 0, 0, 1);
+  CHECK(!allow(*acl, in, ipv4(17, src, dns, 5, 53)));
+  CHECK(allow(*acl, in, ipv4(17, src, dns, 5, 54)));
+  // The first fragment has the real ports, later ones do not.
+  CHECK(allow(*acl, in, ipv4(17, src, dns, 5, 54, 0x2000)));
+  CHECK(!allow(*acl, in, ipv4(17, src, dns, 5, 54, 185)));
+  CHECK(!allow(*acl, in, ipv4(17, src, dns, 5, 54, 0x2000 | 185)));
+  // Fragments to another host are left alone.
+  CHECK(allow(*acl, in, ipv4(17, src, ip(10, 0, 0, 3), 5, 54, 185)));
+
+  // A bad IHL is dropped whatever the rules say.
+  std::vector<uint8_t> bad = ipv4(17, src, ip(10, 0, 0, 3), 5, 54);
+  bad[0] = 0x44;
+  CHECK(!allow(*acl, in, bad));
+  bad[0] = 0x4f;
+  CHECK(!allow(*acl, in, bad));
+}
+
+// IPv6 only matches rules without addresses or ports, on its next header.
+void test_ipv6() {
+  std::shared_ptr<const Acl> acl = load(
+    "deny src 10.0.0.0/8\n"
+    "deny dport 22\n"
+    "deny proto udp\n"
+    "default allow\n");
+  CHECK(allow(*acl, in, ipv6(6)));
+  CHECK(!allow(*acl, in, ipv6(17)));
+  CHECK(!allow(*acl, out, ipv6(17)));
+
+  acl = load("allow proto tcp\ndefault deny\n");
+  CHECK(allow(*acl, in, ipv6(6)));
+  CHECK(!allow(*acl, in, ipv6(17)));
+
+  // Without any rule everything passes.
+  acl = load("");
+  CHECK(allow(*acl, in, ipv6(17)));
+  CHECK(allow(*acl, in, ipv4(17, 1, 2, 3, 4)));
+}
+
+}
+
+int main() {
+  test_syntax();
+  test_rule_limit();
+  test_matching();
+  test_fragments();
+  test_ipv6();
+  printf("acl_test passed\n");
+  return 0;
+}
@@ -0,0 +1,22 @@
+//
+//  check.hpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#ifndef check_hpp
+#define check_hpp
+
+#include <cstdio>
+#include <cstdlib>
+
+// Fail the test program with the condition and where it was checked.
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    exit(EXIT_FAILURE); \
+  } \
+} while (0)
+
+#endif /* check_hpp */
@@ -0,0 +1,153 @@
+//
+//  packet_api_test.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "check.hpp"
+#include "libbridge.hpp"
+#include "pipeline.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// A minimal IPv4 or IPv6 header followed by a recognisable payload.
+std::vector<uint8_t> make_packet(int version, std::size_t len) {
+  std::vector<uint8_t> pkt(len);
+  for (std::size_t i = 0; i < len; ++i) {
+    pkt[i] = (uint8_t) i;
+  }
+  pkt[0] = version == 6 ? 0x60 : 0x45;
+  return pkt;
+}
+
+// The macOS utun stage is plain C++ and runs on every platform here.
+void test_family_header() {
+  using Stack = Pipeline<AppleFamilyHeader, AclFilter, Cipher>;
+  const uint32_t families[] = {AF_INET, AF_INET6};
+  const int versions[] = {4, 6};
+  for (int i = 0; i < 2; ++i) {
+    Stack stack(AppleFamilyHeader(), AclFilter(nullptr), Cipher(7));
+    std::vector<uint8_t> inner = make_packet(versions[i], 60);
+    uint8_t buf[256] = {};
+    uint8_t* p = buf + crypto_header_len;
+    p[0] = (uint8_t) (families[i] >> 24);
+    p[1] = (uint8_t) (families[i] >> 16);
+    p[2] = (uint8_t) (families[i] >> 8);
+    p[3] = (uint8_t) families[i];
+    memcpy(p + 4, inner.data(), inner.size());
+    std::vector<uint8_t> framed(p, p + inner.size() + 4);
+
+    Packet out;
+    out.buf = buf;
+    out.size = sizeof(buf);
+    out.offst = crypto_header_len;
+    out.len = inner.size() + 4;
+    out.gen_id = 1;
+    out.seq = 1;
+    CHECK(stack.outbound(out));
+
+    uint8_t wire[256] = {};
+    memcpy(wire, out.data(), out.len);
+    Packet in;
+    in.buf = wire;
+    in.size = sizeof(wire);
+    in.len = out.len;
+    CHECK(stack.inbound(in));
+    CHECK(!in.control);
+    CHECK(in.len == framed.size());
+    CHECK(memcmp(in.data(), framed.data(), in.len) == 0);
+  }
+
+  // Control messages never carry the family header.
+  Stack stack(AppleFamilyHeader(), AclFilter(nullptr), Cipher(7));
+  uint8_t buf[256] = {};
+  Packet out;
+  out.buf = buf;
+  out.size = sizeof(buf);
+  out.offst = crypto_header_len;
+  out.len = control_len;
+  Control ctrl;
+  ctrl.type = control_rate;
+  pack_control(out.data(), ctrl);
+  CHECK(stack.stage<Cipher>().outbound(out));
+  Packet in;
+  in.buf = out.data();
+  in.size = out.len;
+  in.len = out.len;
+  CHECK(stack.inbound(in));
+  CHECK(in.control);
+  CHECK(in.len == control_len);
+  CHECK(in.data()[0] == control_rate);
+}
+
+// Both families through Client::submit and Server::submit and back out of
+// the other end's PacketHandler.
+void test_submit() {
+  boost::asio::io_context io;
+  Options opts;
+  std::vector<std::vector<uint8_t>> at_server;
+  std::vector<std::vector<uint8_t>> at_client;
+  // Port 0 lets the system pick a free one, the client is told which.
+  Server server(io, "127.0.0.1", "0", 7, opts,
+                [&](const uint8_t* data, std::size_t len) {
+                  at_server.emplace_back(data, data + len);
+                });
+  std::string port = std::to_string(server.local_endpoint().port());
+  CHECK(port != "0");
+  Client client(io, "127.0.0.1", port, 7, opts,
+                [&](const uint8_t* data, std::size_t len) {
+                  at_client.emplace_back(data, data + len);
+                });
+  server.start();
+  client.start();
+
+  std::vector<uint8_t> v4 = make_packet(4, 100);
+  std::vector<uint8_t> v6 = make_packet(6, 120);
+  PacketView pkts[] = {{v4.data(), v4.size()}, {v6.data(), v6.size()}};
+  client.submit(pkts, 2);
+
+  boost::asio::steady_timer timer(io);
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::function<void()> poll = [&] {
+    timer.expires_after(std::chrono::milliseconds(10));
+    timer.async_wait([&](const boost::system::error_code&) {
+      if (at_server.size() == 2 && at_client.empty()) {
+        // The server knows the client's address now.
+        server.submit(pkts, 2);
+      }
+      if (at_client.size() == 2
+          || std::chrono::steady_clock::now() > deadline) {
+        io.stop();
+        return;
+      }
+      poll();
+    });
+  };
+  poll();
+  io.run();
+
+  CHECK(at_server.size() == 2);
+  CHECK(at_server[0] == v4);
+  CHECK(at_server[1] == v6);
+  CHECK(at_client.size() == 2);
+  CHECK(at_client[0] == v4);
+  CHECK(at_client[1] == v6);
+}
+
+}
+
+int main() {
+  test_family_header();
+  test_submit();
+  printf("packet_api_test passed\n");
+  return 0;
+}
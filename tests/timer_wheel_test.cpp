@@ -0,0 +1,213 @@
+//
+//  timer_wheel_test.cpp
+//  bridge
+//
+//  Created by 冀宸 on 2026/10/19.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "check.hpp"
+#include "timer_wheel.hpp"
+
+using namespace bridge;
+
+namespace {
+
+// A wheel on a clock that only moves when told to. The io_context is
+// never run, expire() is called by hand instead. Ticks are a second long
+// so that the real time spent building the wheel stays well inside the
+// first one.
+class FakeWheel : public TimerWheel {
+ public:
+  explicit FakeWheel(boost::asio::io_context& io)
+      : TimerWheel(io, std::chrono::seconds(1)), now_(clock::now()) { }
+
+  // Move the clock forward by ticks and run what is due.
+  void advance(uint64_t ticks) {
+    now_ += std::chrono::seconds(ticks);
+    expire();
+  }
+
+ protected:
+  clock::time_point now() const override { return now_; }
+
+ private:
+  clock::time_point now_;
+};
+
+std::chrono::seconds ticks(uint64_t n) {
+  return std::chrono::seconds(n);
+}
+
+// A timer fires on the tick it was due, not one earlier or later, also
+// right at and next to the 256, 2^16 and 2^24 tick level boundaries.
+void test_boundaries(uint64_t phase) {
+  boost::asio::io_context io;
+  FakeWheel wheel(io);
+  // Start off a level boundary, so slots have wrapped before the first
+  // expiry for phase > 0.
+  wheel.advance(phase);
+
+  const uint64_t due[] = {
+    1, 2, 254, 255, 256, 257, 511, 512, 513,
+    65535, 65536, 65537, 65536 + 255, 65536 + 256,
+    (1 << 24) - 1, 1 << 24, (1 << 24) + 1, (1 << 24) + 65536,
+  };
+  const std::size_t n = sizeof(due) / sizeof(due[0]);
+  std::vector<std::unique_ptr<TimerWheel::Timer>> timers;
+  std::vector<uint64_t> fired(n, 0);
+  uint64_t elapsed = 0;
+  for (std::size_t i = 0; i < n; ++i) {
+    timers.emplace_back(new TimerWheel::Timer());
+    wheel.schedule(*timers[i], ticks(due[i]), [&fired, &elapsed, i] {
+      fired[i] = elapsed;
+    });
+  }
+  CHECK(wheel.size() == n);
+
+  // Jump to one tick short of every expiry, then step onto it.
+  for (std::size_t i = 0; i < n; ++i) {
+    if (due[i] - 1 > elapsed) {
+      wheel.advance(due[i] - 1 - elapsed);
+      elapsed = due[i] - 1;
+    }
+    CHECK(!fired[i]);
+    CHECK(timers[i]->pending());
+    ++elapsed;
+    wheel.advance(1);
+    CHECK(fired[i] == due[i]);
+    CHECK(!timers[i]->pending());
+  }
+  CHECK(wheel.size() == 0);
+}
+
+// Delays past the top level, 2^32 ticks, park and cascade again.
+void test_wrap() {
+  boost::asio::io_context io;
+  FakeWheel wheel(io);
+  const uint64_t top = uint64_t(1) << 32;
+  TimerWheel::Timer far;
+  TimerWheel::Timer near;
+  bool far_fired = false;
+  bool near_fired = false;
+  wheel.schedule(far, ticks(top + 300), [&far_fired] { far_fired = true; });
+  wheel.schedule(near, ticks(top - 1), [&near_fired] { near_fired = true; });
+
+  wheel.advance(top - 2);
+  CHECK(!near_fired);
+  wheel.advance(1);
+  CHECK(near_fired);
+  wheel.advance(300);
+  CHECK(!far_fired);
+  CHECK(far.pending());
+  wheel.advance(1);
+  CHECK(far_fired);
+}
+
+// after == 0 and negative delays run on the next tick: never within
+// schedule() or the tick already handled, and never later.
+void test_zero_delay() {
+  boost::asio::io_context io;
+  FakeWheel wheel(io);
+  wheel.advance(1000);
+  TimerWheel::Timer zero;
+  TimerWheel::Timer negative;
+  int fired = 0;
+  wheel.schedule(zero, ticks(0), [&fired] { ++fired; });
+  wheel.schedule(negative, -ticks(5), [&fired] { ++fired; });
+  wheel.advance(0);
+  CHECK(fired == 0);
+  wheel.advance(1);
+  CHECK(fired == 2);
+
+  // A callback scheduling itself with no delay runs once per tick, not in
+  // a loop within one.
+  int rounds = 0;
+  std::function<void()> again = [&] {
+    if (++rounds < 3) {
+      wheel.schedule(zero, ticks(0), again);
+    }
+  };
+  wheel.schedule(zero, ticks(0), again);
+  wheel.advance(1);
+  CHECK(rounds == 1);
+  wheel.advance(1);
+  CHECK(rounds == 2);
+  wheel.advance(1);
+  CHECK(rounds == 3);
+  CHECK(wheel.size() == 0);
+}
+
+// A callback may cancel or reschedule timers due in the same tick.
+void test_cancel_from_callback() {
+  boost::asio::io_context io;
+  FakeWheel wheel(io);
+  TimerWheel::Timer a;
+  TimerWheel::Timer b;
+  TimerWheel::Timer c;
+  int a_fired = 0;
+  int b_fired = 0;
+  int c_fired = 0;
+  // All three share a slot and run in the order they were scheduled, so a
+  // runs first, cancels b and moves c.
+  auto first = [&](TimerWheel::Timer& victim, TimerWheel::Timer& moved) {
+    victim.cancel();
+    wheel.schedule(moved, ticks(10), [&c_fired] { ++c_fired; });
+  };
+  wheel.schedule(a, ticks(5), [&] { ++a_fired; first(b, c); });
+  wheel.schedule(b, ticks(5), [&] { ++b_fired; });
+  wheel.schedule(c, ticks(5), [&] { ++c_fired; });
+
+  wheel.advance(5);
+  CHECK(a_fired == 1);
+  CHECK(b_fired == 0);
+  CHECK(!b.pending());
+  CHECK(c_fired == 0);
+  CHECK(c.pending());
+  wheel.advance(9);
+  CHECK(c_fired == 0);
+  wheel.advance(1);
+  CHECK(c_fired == 1);
+
+  // Cancelling a timer parked on an upper level.
+  wheel.schedule(a, ticks(70000), [&a_fired] { ++a_fired; });
+  CHECK(wheel.size() == 1);
+  a.cancel();
+  CHECK(wheel.size() == 0);
+  wheel.advance(70000);
+  CHECK(a_fired == 1);
+}
+
+// Timers due in one expire() run in expiry order.
+void test_order() {
+  boost::asio::io_context io;
+  FakeWheel wheel(io);
+  std::vector<int> order;
+  TimerWheel::Timer t[4];
+  const uint64_t due[] = {300, 5, 70000, 256};
+  for (int i = 0; i < 4; ++i) {
+    wheel.schedule(t[i], ticks(due[i]), [&order, i] { order.push_back(i); });
+  }
+  wheel.advance(100000);
+  CHECK((order == std::vector<int>{1, 3, 0, 2}));
+}
+
+}
+
+int main() {
+  test_boundaries(0);
+  test_boundaries(1);
+  test_boundaries(200);
+  test_boundaries(65530);
+  test_wrap();
+  test_zero_delay();
+  test_cancel_from_callback();
+  test_order();
+  printf("timer_wheel_test passed\n");
+  return 0;
+}